@@ -0,0 +1,87 @@
+// Times round trips between the main thread and a fiber through impl::fiber::switch_to, which is nova_fiber_switch on
+// POSIX. Each round trip is two switches. Runs once with start_options::float_state on, which saves and restores the
+// floating-point control registers on every switch, and once with it off.
+//
+// Then times nova::call under start_sync on one thread, with a recursive fib that calls itself twice per level, again
+// with float_state on and off. Each call there queues a job, runs one Runnable inline, and usually switches fibers for
+// the other.
+//
+//   g++ -std=c++17 -O2 -I.. fiber_switch.cpp -o fiber_switch -pthread
+//   ./fiber_switch [round trips] [fib n]
+
+#include "nova.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+namespace {
+	nova::impl::fiber* main_fiber = nullptr;
+
+	void bounce() {
+		for (;;)
+			main_fiber->switch_to();
+	}
+
+	double round_trip_ns(nova::impl::fiber* f, std::size_t roundTrips) {
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		for (std::size_t i = 0; i < roundTrips; i++)
+			f->switch_to();
+		std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+		return elapsed.count() / roundTrips;
+	}
+
+	std::size_t calls = 0;
+
+	long fib(int n) {
+		if (n < 2)
+			return n;
+		calls++;
+		long a, b;
+		nova::call([&] { a = fib(n - 1); }, [&] { b = fib(n - 2); });
+		return a + b;
+	}
+
+	double call_ns(int n) {
+		calls = 0;
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		fib(n);
+		std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+		return elapsed.count() / calls;
+	}
+}
+
+int main(int argc, char** argv) {
+	std::size_t roundTrips = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 10000000;
+	int fibN = argc > 2 ? std::atoi(argv[2]) : 24;
+	if (roundTrips == 0 || fibN < 2)
+		return 1;
+
+	main_fiber = nova::impl::fiber::convert_thread();
+
+	// float_state has to be the same for every switch to and from a fiber, so each setting gets a fiber of its own.
+	for (bool floatState : { true, false }) {
+		nova::impl::fiber::float_state() = floatState;
+		nova::impl::fiber* f = nova::impl::fiber::create(&bounce, 0);
+
+		// Warm up the stack and the branch predictors before timing.
+		round_trip_ns(f, roundTrips / 10 + 1);
+		std::printf("float_state %-5s %zu round trips: %.1f ns per round trip\n", floatState ? "on" : "off", roundTrips, round_trip_ns(f, roundTrips));
+	}
+
+	// The fibers never return, so they're left suspended rather than destroyed.
+	nova::impl::fiber::float_state() = true;
+	nova::impl::fiber::revert_thread();
+
+	for (bool floatState : { true, false }) {
+		nova::start_options options;
+		options.thread_count = 1;
+		options.float_state = floatState;
+		nova::start_sync(options, [floatState, fibN] {
+			call_ns(fibN);
+			double ns = call_ns(fibN);
+			std::printf("float_state %-5s fib(%d), %zu calls: %.1f ns per call\n", floatState ? "on" : "off", fibN, calls, ns);
+		});
+	}
+	return 0;
+}
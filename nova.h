@@ -8,17 +8,283 @@
 #include <thread>
 #include <mutex>
 #include <tuple>
-#include <Windows.h>
 #include <memory>
 #include <cmath>
 #include <algorithm>
 #include <iterator>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+#if defined(_WIN32)
+#include <Windows.h>
+#if defined(_MSC_VER)
+#pragma comment(lib, "Synchronization.lib")
+#endif
+#else
+#include <dirent.h>
+#include <linux/futex.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#define NOVA_COROUTINES 1
+#include <coroutine>
+#include <exception>
+#include <optional>
+#else
+#define NOVA_COROUTINES 0
+#endif
 
 #include "concurrentqueue.h"
 
 #define NOVA_CACHE_LINE_BYTES 64
+// Size of a queued job, a multiple of NOVA_CACHE_LINE_BYTES. 8 bytes go to its descriptor, and Runnables that don't fit in the
+// rest are allocated; jobs pushed with dependent give another 8 bytes to their dependency token. Raising it to 128 or 192
+// trades queue memory for fewer allocations; define NOVA_REPORT_SPILLS to get a warning naming each Runnable that's allocated.
+#ifndef NOVA_JOB_BYTES
+#define NOVA_JOB_BYTES NOVA_CACHE_LINE_BYTES
+#endif
+// Largest block, header included, that Runnables too big for their job are given from the per-thread pools. Bigger ones go
+// straight to the heap.
+#ifndef NOVA_SPILL_POOL_MAX_BYTES
+#define NOVA_SPILL_POOL_MAX_BYTES 4096
+#endif
+// Blocks carved out of each slab a spill pool allocates.
+#ifndef NOVA_SPILL_SLAB_BLOCKS
+#define NOVA_SPILL_SLAB_BLOCKS 32
+#endif
+// Default for start_options::max_spin.
+#ifndef NOVA_SPIN_COUNT
 #define NOVA_SPIN_COUNT 10000
+#endif
+// Smallest spin budget an idle thread adapts down to, unless max_spin is lower.
+#ifndef NOVA_MIN_SPIN_COUNT
+#define NOVA_MIN_SPIN_COUNT 64
+#endif
+// Most pause instructions an idle thread issues between two looks for work.
+#ifndef NOVA_MAX_SPIN_BACKOFF
+#define NOVA_MAX_SPIN_BACKOFF 64
+#endif
+// Pause instructions a thread spends looking for work before it takes the job waiting in another thread's next slot.
+#ifndef NOVA_NEXT_STEAL_SPINS
+#define NOVA_NEXT_STEAL_SPINS 64
+#endif
+// Number of priority levels, see nova::priority. Level 0 is the most urgent.
+#ifndef NOVA_PRIORITY_LEVELS
+#define NOVA_PRIORITY_LEVELS 3
+#endif
+// Level of jobs pushed without a priority control.
+#ifndef NOVA_DEFAULT_PRIORITY
+#define NOVA_DEFAULT_PRIORITY 1
+#endif
+// Every this many pops, a thread looks at the least urgent levels first so they can't starve.
+#ifndef NOVA_PRIORITY_AGING_INTERVAL
+#define NOVA_PRIORITY_AGING_INTERVAL 32
+#endif
+// Default for start_options::return_same_wait, in microseconds.
+#ifndef NOVA_RETURN_SAME_WAIT_US
+#define NOVA_RETURN_SAME_WAIT_US 50
+#endif
+// Default fiber stack size; override per run with start_options::stack_size.
+#ifndef NOVA_FIBER_STACK_BYTES
+#define NOVA_FIBER_STACK_BYTES (1024 * 1024)
+#endif
+// Smallest fiber stack size class. Stack sizes are rounded up to a power-of-two multiple of this.
+#ifndef NOVA_MIN_FIBER_STACK_BYTES
+#define NOVA_MIN_FIBER_STACK_BYTES 8192
+#endif
+// Number of idle fibers moved between a thread's fiber cache and the global depot at once. A thread caches up to twice this
+// many fibers of each size class.
+#ifndef NOVA_FIBER_BATCH_SIZE
+#define NOVA_FIBER_BATCH_SIZE 16
+#endif
+
+// Accessors for thread_local state must not be inlined: a fiber can be suspended on one thread and resumed on
+// another, and an inlined accessor lets the compiler reuse the old thread's TLS address after the switch.
+#if defined(_MSC_VER)
+#define NOVA_NOINLINE __declspec(noinline)
+#elif defined(__clang__)
+#define NOVA_NOINLINE __attribute__((noinline))
+#else
+#define NOVA_NOINLINE __attribute__((noinline, noipa))
+#endif
+
+#if !defined(_WIN32)
+
+// Context switch for the POSIX fiber backend. Pushes the callee-saved registers and the floating-point control
+// state onto the current stack, stores the stack pointer to *from, then pops the same from to. Nothing else is
+// saved, so unlike swapcontext there's no signal mask syscall. The code lives in a COMDAT group so that every
+// translation unit including this header can emit it.
+extern "C" __attribute__((visibility("hidden"))) void nova_fiber_switch(void** from, void* to);
+// Same frame as nova_fiber_switch, but the floating-point control slot is left alone.
+extern "C" __attribute__((visibility("hidden"))) void nova_fiber_switch_no_float(void** from, void* to);
+// First frame of a new fiber; calls the routine in the second saved register with the first as its argument.
+extern "C" __attribute__((visibility("hidden"))) void nova_fiber_entry();
+
+#if defined(__x86_64__) && defined(__ELF__)
+asm(R"(
+	.pushsection .text.nova_fiber_switch,"axG",@progbits,nova_fiber_switch,comdat
+	.globl nova_fiber_switch
+	.hidden nova_fiber_switch
+	.type nova_fiber_switch,@function
+	.p2align 4
+nova_fiber_switch:
+	pushq %rbp
+	pushq %rbx
+	pushq %r12
+	pushq %r13
+	pushq %r14
+	pushq %r15
+	subq $8, %rsp
+	stmxcsr (%rsp)
+	fnstcw 4(%rsp)
+	movq %rsp, (%rdi)
+	movq %rsi, %rsp
+	ldmxcsr (%rsp)
+	fldcw 4(%rsp)
+	addq $8, %rsp
+	popq %r15
+	popq %r14
+	popq %r13
+	popq %r12
+	popq %rbx
+	popq %rbp
+	ret
+	.size nova_fiber_switch,.-nova_fiber_switch
+
+	.globl nova_fiber_entry
+	.hidden nova_fiber_entry
+	.type nova_fiber_entry,@function
+	.p2align 4
+nova_fiber_entry:
+	movq %rbx, %rdi
+	callq *%r12
+	ud2
+	.size nova_fiber_entry,.-nova_fiber_entry
+
+	.globl nova_fiber_switch_no_float
+	.hidden nova_fiber_switch_no_float
+	.type nova_fiber_switch_no_float,@function
+	.p2align 4
+nova_fiber_switch_no_float:
+	pushq %rbp
+	pushq %rbx
+	pushq %r12
+	pushq %r13
+	pushq %r14
+	pushq %r15
+	subq $8, %rsp
+	movq %rsp, (%rdi)
+	movq %rsi, %rsp
+	addq $8, %rsp
+	popq %r15
+	popq %r14
+	popq %r13
+	popq %r12
+	popq %rbx
+	popq %rbp
+	ret
+	.size nova_fiber_switch_no_float,.-nova_fiber_switch_no_float
+	.popsection
+)");
+#elif defined(__aarch64__) && defined(__ELF__)
+asm(R"(
+	.pushsection .text.nova_fiber_switch,"axG",%progbits,nova_fiber_switch,comdat
+	.globl nova_fiber_switch
+	.hidden nova_fiber_switch
+	.type nova_fiber_switch,%function
+	.p2align 4
+nova_fiber_switch:
+	sub sp, sp, #176
+	stp x19, x20, [sp, #0]
+	stp x21, x22, [sp, #16]
+	stp x23, x24, [sp, #32]
+	stp x25, x26, [sp, #48]
+	stp x27, x28, [sp, #64]
+	stp x29, x30, [sp, #80]
+	stp d8, d9, [sp, #96]
+	stp d10, d11, [sp, #112]
+	stp d12, d13, [sp, #128]
+	stp d14, d15, [sp, #144]
+	mrs x9, fpcr
+	str x9, [sp, #160]
+	mov x9, sp
+	str x9, [x0]
+	mov sp, x1
+	ldr x9, [sp, #160]
+	msr fpcr, x9
+	ldp x19, x20, [sp, #0]
+	ldp x21, x22, [sp, #16]
+	ldp x23, x24, [sp, #32]
+	ldp x25, x26, [sp, #48]
+	ldp x27, x28, [sp, #64]
+	ldp x29, x30, [sp, #80]
+	ldp d8, d9, [sp, #96]
+	ldp d10, d11, [sp, #112]
+	ldp d12, d13, [sp, #128]
+	ldp d14, d15, [sp, #144]
+	add sp, sp, #176
+	ret
+	.size nova_fiber_switch,.-nova_fiber_switch
+
+	.globl nova_fiber_entry
+	.hidden nova_fiber_entry
+	.type nova_fiber_entry,%function
+	.p2align 4
+nova_fiber_entry:
+	mov x0, x19
+	blr x20
+	brk #0
+	.size nova_fiber_entry,.-nova_fiber_entry
+
+	.globl nova_fiber_switch_no_float
+	.hidden nova_fiber_switch_no_float
+	.type nova_fiber_switch_no_float,%function
+	.p2align 4
+nova_fiber_switch_no_float:
+	sub sp, sp, #176
+	stp x19, x20, [sp, #0]
+	stp x21, x22, [sp, #16]
+	stp x23, x24, [sp, #32]
+	stp x25, x26, [sp, #48]
+	stp x27, x28, [sp, #64]
+	stp x29, x30, [sp, #80]
+	stp d8, d9, [sp, #96]
+	stp d10, d11, [sp, #112]
+	stp d12, d13, [sp, #128]
+	stp d14, d15, [sp, #144]
+	mov x9, sp
+	str x9, [x0]
+	mov sp, x1
+	ldp x19, x20, [sp, #0]
+	ldp x21, x22, [sp, #16]
+	ldp x23, x24, [sp, #32]
+	ldp x25, x26, [sp, #48]
+	ldp x27, x28, [sp, #64]
+	ldp x29, x30, [sp, #80]
+	ldp d8, d9, [sp, #96]
+	ldp d10, d11, [sp, #112]
+	ldp d12, d13, [sp, #128]
+	ldp d14, d15, [sp, #144]
+	add sp, sp, #176
+	ret
+	.size nova_fiber_switch_no_float,.-nova_fiber_switch_no_float
+	.popsection
+)");
+#else
+#error "nova: the POSIX fiber backend supports x86-64 and AArch64 ELF targets"
+#endif
+
+#endif
 
 namespace nova {
 
@@ -36,11 +302,6 @@ namespace nova {
 			static const bool value = true;
 		};
 
-		template<typename T>
-		void to_new_loc(void* loc, T&& obj) {
-			new (loc) T(std::forward<T>(obj));
-		}
-
 		template<typename Runnable>
 		static void run_runnable(Runnable* runnable) {
 			if constexpr(is_shared<Runnable>::value)
@@ -57,20 +318,6 @@ namespace nova {
 				: static_cast<std::size_t>(num) + ((num > 0) ? 1 : 0);
 		}
 
-		template<typename T>
-		class raii_ptr {
-		public:
-			raii_ptr(std::decay_t<T> *& ptr, std::decay_t<T> * val)
-				: m_ptr(ptr) {
-				m_ptr = val;
-			}
-			~raii_ptr() {
-				m_ptr = nullptr;
-			}
-		private:
-			T *& m_ptr;
-		};
-
 		namespace detail {
 			template <class F, class... Args>
 			inline auto INVOKE(F&& f, Args&&... args) ->
@@ -146,198 +393,801 @@ namespace nova {
 
 #pragma endregion
 
+#pragma region fiber
+
+	namespace impl {
+		typedef void(*fiber_start_routine)();
+
+		// Fibers are pooled by stack size class; class c has a stack of NOVA_MIN_FIBER_STACK_BYTES << c bytes.
+		static const std::uint8_t stack_class_count = 16;
+		// Stands in for the class picked by start_options::stack_size.
+		static const std::uint8_t default_stack_class = 0xFE;
+		// A job that's small enough to run on any fiber.
+		static const std::uint8_t any_stack_class = 0xFD;
+		// A thread converted to a fiber; it runs on the thread's own stack.
+		static const std::uint8_t thread_stack_class = 0xFF;
+
+		constexpr std::size_t stack_class_size(std::uint8_t stackClass) {
+			return static_cast<std::size_t>(NOVA_MIN_FIBER_STACK_BYTES) << stackClass;
+		}
+
+		constexpr std::uint8_t stack_class_for(std::size_t bytes, std::uint8_t stackClass = 0) {
+			return (stackClass + 1 >= stack_class_count || stack_class_size(stackClass) >= bytes)
+				? stackClass
+				: stack_class_for(bytes, stackClass + 1);
+		}
+
+		// Stack size class needed by Runnables of type T when they're queued on their own.
+		template<typename T>
+		struct runnable_stack_class {
+			static const std::uint8_t value = default_stack_class;
+		};
+
+		// Wraps a Runnable that's given a stack size class, for jobs that own their Runnable and so can't store one.
+		template<typename T, std::uint8_t StackClass>
+		struct stack_class_runnable {
+			T runnable;
+
+			void operator()() {
+				run_runnable(&runnable);
+			}
+		};
+
+		template<typename T, std::uint8_t StackClass>
+		struct runnable_stack_class<stack_class_runnable<T, StackClass>> {
+			static const std::uint8_t value = StackClass;
+		};
+
+#if defined(_WIN32)
+		// Thin wrapper over a Win32 fiber; the wrapper is the fiber data, so current() is just GetFiberData.
+		class fiber {
+		public:
+			static fiber* create(fiber_start_routine start, std::uint8_t stackClass) {
+				fiber* f = new fiber(start, stackClass);
+				f->m_handle = CreateFiberEx(0, stack_class_size(stackClass), float_flags(), &fiber::entry, f);
+				return f;
+			}
+			static void destroy(fiber* f) {
+				DeleteFiber(f->m_handle);
+				delete f;
+			}
+			// Turns the calling thread into a fiber so it can switch to others.
+			static fiber* convert_thread() {
+				fiber* f = new fiber(nullptr, thread_stack_class);
+				f->m_handle = ConvertThreadToFiberEx(f, float_flags());
+				return f;
+			}
+			static void revert_thread() {
+				fiber* f = current();
+				ConvertFiberToThread();
+				delete f;
+			}
+			static fiber* current() {
+				return static_cast<fiber*>(GetFiberData());
+			}
+			// Whether switches save and restore the floating-point control state. Only read when fibers are created,
+			// so it has to be set before any are.
+			static bool& float_state() {
+				static bool fs = true;
+				return fs;
+			}
+			// Bytes of stack left below the caller on the current fiber.
+			static std::size_t stack_left() {
+				ULONG_PTR low, high;
+				GetCurrentThreadStackLimits(&low, &high);
+				char probe;
+				return reinterpret_cast<ULONG_PTR>(&probe) - low;
+			}
+			// Suspends the current fiber and resumes this one.
+			void switch_to() {
+				SwitchToFiber(m_handle);
+			}
+			std::uint8_t stack_class() const {
+				return m_stackClass;
+			}
+			// Links idle fibers into batches in the fiber depot.
+			fiber*& next() {
+				return m_next;
+			}
+		private:
+			fiber(fiber_start_routine start, std::uint8_t stackClass)
+				: m_start(start), m_stackClass(stackClass) {
+			}
+			static void WINAPI entry(LPVOID self) {
+				static_cast<fiber*>(self)->m_start();
+			}
+			static DWORD float_flags() {
+				return float_state() ? FIBER_FLAG_FLOAT_SWITCH : 0;
+			}
+
+			LPVOID m_handle = nullptr;
+			fiber_start_routine m_start;
+			fiber* m_next = nullptr;
+			std::uint8_t m_stackClass;
+		};
+#else
+		// Hands out fiber stacks reserved with mmap, each with a PROT_NONE guard page below it so that an overflow
+		// faults instead of running into the neighbouring mapping. Pages are only committed as the fiber touches them.
+		// Stacks released by destroyed fibers are cached and handed out again, which skips the mmap/mprotect pair.
+		class stack_allocator {
+		public:
+			struct stack {
+				void* base;
+				std::size_t size;
+			};
+
+			static stack allocate(std::size_t size) {
+				size = round_to_page(size);
+				{
+					std::lock_guard<std::mutex> lock(instance().m_lock);
+					std::vector<stack>& cache = instance().m_cache;
+					for (auto it = cache.begin(); it != cache.end(); ++it) {
+						if (it->size == size) {
+							stack s = *it;
+							cache.erase(it);
+							return s;
+						}
+					}
+				}
+
+				int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+#if defined(MAP_STACK)
+				flags |= MAP_STACK;
+#endif
+				void* mapping = mmap(nullptr, size + page_size(), PROT_READ | PROT_WRITE, flags, -1, 0);
+				if (mapping == MAP_FAILED)
+					throw std::bad_alloc();
+				// A stack without its guard page would overflow silently, so that's a failure too.
+				if (mprotect(mapping, page_size(), PROT_NONE)) {
+					munmap(mapping, size + page_size());
+					throw std::bad_alloc();
+				}
+				return { static_cast<char*>(mapping) + page_size(), size };
+			}
+
+			static void deallocate(stack s) {
+				std::lock_guard<std::mutex> lock(instance().m_lock);
+				instance().m_cache.push_back(s);
+			}
+
+			// Unmaps every cached stack.
+			static void release_cache() {
+				std::lock_guard<std::mutex> lock(instance().m_lock);
+				for (stack& s : instance().m_cache)
+					munmap(static_cast<char*>(s.base) - page_size(), s.size + page_size());
+				instance().m_cache.clear();
+			}
+
+			static std::size_t page_size() {
+				static const std::size_t size = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+				return size;
+			}
+		private:
+			static std::size_t round_to_page(std::size_t size) {
+				return (std::max)((size + page_size() - 1) / page_size(), static_cast<std::size_t>(1)) * page_size();
+			}
+
+			static stack_allocator& instance() {
+				static stack_allocator sa;
+				return sa;
+			}
+
+			std::mutex m_lock;
+			std::vector<stack> m_cache;
+		};
+
+		// Stackful coroutine switched by nova_fiber_switch. A suspended fiber is nothing but its saved stack pointer;
+		// the registers are on the stack it points to.
+		class fiber {
+		public:
+			static fiber* create(fiber_start_routine start, std::uint8_t stackClass) {
+				fiber* f = new fiber(start, stackClass);
+				f->m_stack = stack_allocator::allocate(stack_class_size(stackClass));
+				f->init_stack();
+				return f;
+			}
+			static void destroy(fiber* f) {
+				if (f->m_stack.base)
+					stack_allocator::deallocate(f->m_stack);
+				delete f;
+			}
+			// Turns the calling thread into a fiber so it can switch to others.
+			static fiber* convert_thread() {
+				fiber* f = new fiber(nullptr, thread_stack_class);
+				current_fiber() = f;
+				return f;
+			}
+			static void revert_thread() {
+				delete current_fiber();
+				current_fiber() = nullptr;
+			}
+			static fiber* current() {
+				return current_fiber();
+			}
+			// Whether switches save and restore the floating-point control state. Every fiber has room for it either
+			// way, but it has to be the same for every switch in a run, since a switch that skips the save leaves the
+			// slot stale for one that loads it.
+			static bool& float_state() {
+				static bool fs = true;
+				return fs;
+			}
+			// Bytes of stack left below the caller on the current fiber. Zero on a converted thread, whose stack isn't
+			// ours to measure.
+			static std::size_t stack_left() {
+				fiber* f = current_fiber();
+				std::uintptr_t sp = reinterpret_cast<std::uintptr_t>(__builtin_frame_address(0));
+				std::uintptr_t low = reinterpret_cast<std::uintptr_t>(f->m_stack.base);
+				return (f->m_stack.base && sp > low) ? sp - low : 0;
+			}
+			// Suspends the current fiber and resumes this one.
+			void switch_to() {
+				fiber*& cf = current_fiber();
+				fiber* self = cf;
+				cf = this;
+				if (float_state())
+					nova_fiber_switch(&self->m_sp, m_sp);
+				else
+					nova_fiber_switch_no_float(&self->m_sp, m_sp);
+			}
+			std::uint8_t stack_class() const {
+				return m_stackClass;
+			}
+			// Links idle fibers into batches in the fiber depot.
+			fiber*& next() {
+				return m_next;
+			}
+			// Gives the pages below the saved stack pointer back to the system. Only valid while the fiber is suspended,
+			// since that's the only time nothing lives there. Returns the number of bytes released.
+			std::size_t trim() {
+				std::uintptr_t low = reinterpret_cast<std::uintptr_t>(m_stack.base);
+				std::uintptr_t high = reinterpret_cast<std::uintptr_t>(m_sp) & ~static_cast<std::uintptr_t>(stack_allocator::page_size() - 1);
+				if (!m_stack.base || high <= low)
+					return 0;
+				madvise(m_stack.base, high - low, MADV_DONTNEED);
+				return high - low;
+			}
+		private:
+			fiber(fiber_start_routine start, std::uint8_t stackClass)
+				: m_start(start), m_stackClass(stackClass) {
+			}
+
+			static void entry(fiber* self) {
+				self->m_start();
+			}
+
+			// Lays out a frame that nova_fiber_switch will pop into nova_fiber_entry, with the stack pointer
+			// aligned the way the ABI expects at a call.
+			void init_stack() {
+				std::uintptr_t top = (reinterpret_cast<std::uintptr_t>(m_stack.base) + m_stack.size) & ~static_cast<std::uintptr_t>(15);
+#if defined(__x86_64__)
+				void** frame = reinterpret_cast<void**>(top) - 10;
+				std::fill(frame, frame + 10, nullptr);
+				frame[0] = reinterpret_cast<void*>((static_cast<std::uintptr_t>(0x037F) << 32) | 0x1F80); // fcw, mxcsr
+				frame[4] = reinterpret_cast<void*>(&fiber::entry); // r12
+				frame[5] = this; // rbx
+				frame[7] = reinterpret_cast<void*>(&nova_fiber_entry); // return address
+#else
+				void** frame = reinterpret_cast<void**>(top) - 22;
+				std::fill(frame, frame + 22, nullptr);
+				frame[0] = this; // x19
+				frame[1] = reinterpret_cast<void*>(&fiber::entry); // x20
+				frame[11] = reinterpret_cast<void*>(&nova_fiber_entry); // x30
+#endif
+				m_sp = frame;
+			}
+
+			NOVA_NOINLINE static fiber*& current_fiber() {
+				static thread_local fiber* cf = nullptr;
+				return cf;
+			}
+
+			void* m_sp = nullptr;
+			stack_allocator::stack m_stack = {};
+			fiber_start_routine m_start;
+			fiber* m_next = nullptr;
+			std::uint8_t m_stackClass;
+		};
+#endif
+	}
+
+#pragma endregion
+
 #pragma region job & dependency_token
 
+	class dependency_token;
+
+	namespace impl {
+		inline bool is_last_copy(const dependency_token& dt);
+		inline bool is_empty(const dependency_token& dt);
+	}
+
 	// Takes a Runnable and invokes it when all copies of the token are released or destroyed.
 	class dependency_token {
 	public:
 		dependency_token() {}
 
-		dependency_token(const dependency_token &) = default;
-		dependency_token& operator=(const dependency_token&) = default;
+		dependency_token(const dependency_token & other);
+		dependency_token& operator=(const dependency_token& other);
 
-		dependency_token(dependency_token &&) = default;
-		dependency_token& operator=(dependency_token&&) = default;
+		dependency_token(dependency_token && other) noexcept
+			: m_token(other.m_token) {
+			other.m_token = nullptr;
+		}
+		dependency_token& operator=(dependency_token&& other) noexcept;
 
 		template<typename Runnable, 
 			std::enable_if_t<!std::is_same<std::decay_t<Runnable>, dependency_token>::value, int> = 0>
 		dependency_token(Runnable&& runnable);
 
-		void Release() {
-			m_token.reset();
+		~dependency_token() {
+			Release();
 		}
+
+		void Release();
+
+#if NOVA_COROUTINES
+		class awaiter;
+
+		// Suspends the awaiting task until every other copy of the token has been released, then resumes it after the
+		// token's Runnable. Awaiting gives up this copy.
+		awaiter operator co_await() &&;
+#endif
 	private:
+		friend bool impl::is_last_copy(const dependency_token& dt);
+		friend bool impl::is_empty(const dependency_token& dt);
+
+		// Counted intrusively, so all the copies share one node that also holds the Runnable.
 		struct shared_token;
-		std::shared_ptr<shared_token> m_token;
+		shared_token* m_token = nullptr;
 	};
 
-	namespace impl{
+	namespace impl {
+		// Default constructed, released, or moved from.
+		inline bool is_empty(const dependency_token& dt) {
+			return !dt.m_token;
+		}
+	}
 
-		class alignas(NOVA_CACHE_LINE_BYTES) job {
-		private:
-			static const std::size_t paddingSize = NOVA_CACHE_LINE_BYTES - sizeof(dependency_token);
+#if NOVA_COROUTINES
+	namespace impl {
+		// A task suspended on a dependency_token, linked into the token's list of waiters.
+		struct token_waiter {
+			std::coroutine_handle<> handle;
+			dependency_token* dependent;
+			token_waiter* next;
+		};
 
-			class job_base {
-			public:
-				virtual ~job_base() {}
-				virtual void move_to(void*) = 0;
-				virtual void operator()() = 0;
-			};
+		inline void resume_token_waiters(token_waiter* waiters);
+	}
+#endif
 
-			class job_empty : job_base {
-			public:
-				virtual void move_to(void* loc) {}
-				virtual void operator()() {}
-			};
+	namespace impl{
 
-			template<typename T>
-			class job_derived : job_empty {
-			public:
-				job_derived(T& t)
-					: runnable(new T(t)) {
+		// Number of power-of-two block sizes from block up to NOVA_SPILL_POOL_MAX_BYTES.
+		constexpr std::size_t spill_class_count(std::size_t block) {
+			return block >= NOVA_SPILL_POOL_MAX_BYTES ? 1 : 1 + spill_class_count(block * 2);
+		}
+
+		// Per-thread pools of power-of-two blocks for Runnables that don't fit in their job. A block freed on another thread
+		// goes back to its pool through a lock-free list, which the owner takes in one go when it runs dry. Blocks can outlive
+		// the thread that allocated them, so pools are never destroyed; a thread that exits leaves its pool for the next
+		// thread to adopt.
+		class spill_pool {
+		public:
+			// Blocks keep their pool and size class in a header, which also sets the alignment they can offer.
+			static const std::size_t alignment = 16;
+
+			static void* allocate(std::size_t size) {
+				std::size_t sizeClass = size_class(size + header_size);
+				spill_pool* pool = current();
+				if (sizeClass == class_count) {
+					pool->m_misses.store(pool->m_misses.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+					return init_block(::operator new(size + header_size), nullptr, sizeClass);
 				}
-				job_derived(T&& t)
-					: runnable(new std::decay_t<T>(std::forward<T>(t))) {
+				free_block*& local = pool->m_local[sizeClass];
+				if (!local)
+					local = pool->m_remote[sizeClass].exchange(nullptr, std::memory_order_acquire);
+				if (local)
+					pool->m_hits.store(pool->m_hits.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+				else {
+					pool->m_misses.store(pool->m_misses.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+					local = pool->carve_slab(sizeClass);
 				}
+				free_block* block = local;
+				local = block->next;
+				return init_block(block, pool, sizeClass);
+			}
 
-				virtual ~job_derived() {
-					delete runnable;
+			static void deallocate(void* p) {
+				header* h = reinterpret_cast<header*>(static_cast<char*>(p) - header_size);
+				if (h->sizeClass == class_count) {
+					::operator delete(h);
+					return;
 				}
+				spill_pool* owner = h->owner;
+				std::size_t sizeClass = h->sizeClass;
+				free_block* block = reinterpret_cast<free_block*>(h);
+				if (owner == current()) {
+					block->next = owner->m_local[sizeClass];
+					owner->m_local[sizeClass] = block;
+					return;
+				}
+				owner->m_remoteFrees.fetch_add(1, std::memory_order_relaxed);
+				block->next = owner->m_remote[sizeClass].load(std::memory_order_relaxed);
+				while (!owner->m_remote[sizeClass].compare_exchange_weak(block->next, block, std::memory_order_release, std::memory_order_relaxed));
+			}
 
-				job_derived(const job_derived& other) = delete;
-				job_derived& operator=(const job_derived&) = delete;
+			struct counters_t {
+				std::size_t hits = 0;
+				std::size_t misses = 0;
+				std::size_t remoteFrees = 0;
+			};
 
-				job_derived(job_derived&& other)
-					: runnable(other.runnable) {
-					other.runnable = nullptr;
+			// Sums the counters of every pool there has been.
+			static counters_t counters() {
+				counters_t c;
+				std::lock_guard<std::mutex> lock(pool_registry().lock);
+				for (spill_pool* pool : pool_registry().all) {
+					c.hits += pool->m_hits.load(std::memory_order_relaxed);
+					c.misses += pool->m_misses.load(std::memory_order_relaxed);
+					c.remoteFrees += pool->m_remoteFrees.load(std::memory_order_relaxed);
 				}
+				return c;
+			}
+		private:
+			struct alignas(alignment) header {
+				spill_pool* owner;
+				std::size_t sizeClass;
+			};
 
-				virtual void move_to(void* loc) {
-					to_new_loc(loc, std::move(*this));
-				}
-				virtual void operator()() {
-					run_runnable(runnable);
-				}
-			private:
-				T* runnable;
+			struct free_block {
+				free_block* next;
 			};
 
-			template<typename T>
-			class job_derived_soo : job_empty {
-			public:
-				job_derived_soo(T& t)
-					: runnable(t) {
-				}
-				job_derived_soo(T&& t)
-					: runnable(std::forward<T>(t)) {
-				}
+			static const std::size_t header_size = sizeof(header);
+			static const std::size_t min_block = 64;
+			static const std::size_t class_count = spill_class_count(min_block);
+
+			// class_count if the size is too big for any class.
+			static std::size_t size_class(std::size_t size) {
+				std::size_t sizeClass = 0;
+				for (std::size_t block = min_block; block < size && sizeClass < class_count; block *= 2)
+					sizeClass++;
+				return sizeClass;
+			}
 
-				job_derived_soo(const job_derived_soo& other) = delete;
-				job_derived_soo& operator=(const job_derived_soo&) = delete;
+			static void* init_block(void* block, spill_pool* owner, std::size_t sizeClass) {
+				new (block) header{ owner, sizeClass };
+				return static_cast<char*>(block) + header_size;
+			}
 
-				job_derived_soo(job_derived_soo&& other) 
-					: runnable(std::move(other.runnable)) {
+			// Slabs are never given back, like the pools themselves.
+			free_block* carve_slab(std::size_t sizeClass) {
+				std::size_t blockSize = min_block << sizeClass;
+				char* slab = static_cast<char*>(::operator new(blockSize * NOVA_SPILL_SLAB_BLOCKS));
+				free_block* head = nullptr;
+				for (std::size_t i = NOVA_SPILL_SLAB_BLOCKS; i-- > 0;) {
+					free_block* block = reinterpret_cast<free_block*>(slab + i * blockSize);
+					block->next = head;
+					head = block;
 				}
+				return head;
+			}
 
-				virtual void move_to(void* loc) {
-					to_new_loc(loc, std::move(*this));
-				}
-				virtual void operator()() {
-					run_runnable(&runnable);
+			struct registry {
+				std::mutex lock;
+				std::vector<spill_pool*> all;
+				std::vector<spill_pool*> abandoned;
+			};
+
+			// Hands a thread's pool back to the registry when the thread exits.
+			struct holder {
+				~holder() {
+					if (!pool)
+						return;
+					std::lock_guard<std::mutex> lock(pool_registry().lock);
+					pool_registry().abandoned.push_back(pool);
 				}
-			private:
-				T runnable;
+				spill_pool* pool = nullptr;
 			};
 
+			// Meyers singletons. The registry is never destroyed, so threads that exit late can still return their pools.
+			static registry& pool_registry() {
+				static registry* r = new registry();
+				return *r;
+			}
+			NOVA_NOINLINE static spill_pool* current() {
+				static thread_local holder h;
+				if (!h.pool) {
+					std::lock_guard<std::mutex> lock(pool_registry().lock);
+					if (pool_registry().abandoned.empty()) {
+						h.pool = new spill_pool();
+						pool_registry().all.push_back(h.pool);
+					}
+					else {
+						h.pool = pool_registry().abandoned.back();
+						pool_registry().abandoned.pop_back();
+					}
+				}
+				return h.pool;
+			}
+
+			free_block* m_local[class_count] = {};
+			std::atomic<free_block*> m_remote[class_count] = {};
+			// Only written by the owner.
+			std::atomic<std::size_t> m_hits{ 0 };
+			std::atomic<std::size_t> m_misses{ 0 };
+			std::atomic<std::size_t> m_remoteFrees{ 0 };
+		};
+
+		// What a job does with its storage, one static instance per kind of job.
+		struct job_ops {
+			void (*invoke)(void* storage);
+			// Null if the storage can be moved by copying its bytes.
+			void (*relocate)(void* from, void* to);
+			// Null if there's nothing to destroy.
+			void (*destroy)(void* storage);
+			// Makes room for a dependency_token, moving the Runnable to a spill pool if it doesn't fit beside one, and returns the
+			// ops of the same kind of job with a token. Null for jobs that have one.
+			const job_ops* (*attach)(void* storage);
+			std::uint8_t stackClass;
+			// Jobs that don't own their Runnable keep their stack class in their storage, after the pointer.
+			bool storedStackClass;
+			// Whether the job keeps a dependency_token at the end of its storage.
+			bool hasToken;
+		};
+
+#if defined(NOVA_REPORT_SPILLS)
+		// Called for every Runnable that's allocated, so the compiler names it and its size in a warning.
+		template<typename Runnable, std::size_t Size>
+		[[deprecated("Runnable doesn't fit in NOVA_JOB_BYTES and is allocated")]]
+		inline void report_spill() {}
+#endif
+
+		class alignas(NOVA_CACHE_LINE_BYTES) job {
+		public:
+			static const std::size_t storageSize = NOVA_JOB_BYTES - sizeof(const job_ops*);
+			// Only jobs that are given a dependency_token carry one, at the end of their storage.
+			static const std::size_t tokenOffset = storageSize - sizeof(dependency_token);
+
 			template<typename T>
-			class job_derived_no_own : job_empty {
-			public:
-				job_derived_no_own(T* t)
-					: runnable(t) {
+			static constexpr bool fits_inline = alignof(T) <= NOVA_CACHE_LINE_BYTES && sizeof(T) <= storageSize;
+			template<typename T>
+			static constexpr bool fits_with_token = alignof(T) <= NOVA_CACHE_LINE_BYTES && sizeof(T) <= tokenOffset;
+		private:
+
+			// Runnables are moved and destroyed through job_ops rather than a vtable, so a job that owns nothing
+			// non-trivial moves with a memcpy and has no destructor to call.
+			template<bool Tokened>
+			struct empty_ops {
+				static void invoke(void*) {}
+				static const job_ops* attach(void*) {
+					return &empty_ops<true>::value;
 				}
+				static constexpr job_ops value{ &invoke, nullptr, nullptr, Tokened ? nullptr : &attach, default_stack_class, false, Tokened };
+			};
 
-				virtual ~job_derived_no_own() = default;
+			template<typename T, bool Tokened>
+			struct heap_ops;
 
-				job_derived_no_own(const job_derived_no_own& other) = delete;
-				job_derived_no_own& operator=(const job_derived_no_own&) = delete;
+			// Runnables that fit are stored in the job.
+			template<typename T, bool Tokened>
+			struct inline_ops {
+				static void invoke(void* storage) {
+					run_runnable(static_cast<T*>(storage));
+				}
+				static void relocate(void* from, void* to) {
+					new (to) T(std::move(*static_cast<T*>(from)));
+					static_cast<T*>(from)->~T();
+				}
+				static void destroy(void* storage) {
+					static_cast<T*>(storage)->~T();
+				}
+				static const job_ops* attach(void* storage) {
+					if constexpr(fits_with_token<T>)
+						return &inline_ops<T, true>::value;
+					else {
+						T* runnable = static_cast<T*>(storage);
+						T* spilled = heap_ops<T, true>::make(std::move(*runnable));
+						runnable->~T();
+						*static_cast<T**>(storage) = spilled;
+						return &heap_ops<T, true>::value;
+					}
+				}
+				static constexpr bool trivial = std::is_trivially_copyable<T>::value;
+				static constexpr job_ops value{ &invoke, trivial ? nullptr : &relocate, trivial ? nullptr : &destroy, Tokened ? nullptr : &attach,
+					runnable_stack_class<T>::value, false, Tokened };
+			};
 
-				job_derived_no_own(job_derived_no_own&& other) {
-					runnable = other.runnable;
-					other.runnable = nullptr;
+			// The rest are allocated, from a spill pool unless they're over-aligned, and the job holds the pointer.
+			template<typename T, bool Tokened>
+			struct heap_ops {
+				static constexpr bool pooled = alignof(T) <= spill_pool::alignment;
+				static T* make(T&& runnable) {
+					if constexpr(pooled)
+						return new (spill_pool::allocate(sizeof(T))) T(std::move(runnable));
+					else
+						return new T(std::move(runnable));
+				}
+				static T* make(const T& runnable) {
+					if constexpr(pooled)
+						return new (spill_pool::allocate(sizeof(T))) T(runnable);
+					else
+						return new T(runnable);
+				}
+				static void invoke(void* storage) {
+					run_runnable(*static_cast<T**>(storage));
+				}
+				static void destroy(void* storage) {
+					T* runnable = *static_cast<T**>(storage);
+					if constexpr(pooled) {
+						runnable->~T();
+						spill_pool::deallocate(runnable);
+					}
+					else {
+						delete runnable;
+					}
+				}
+				static const job_ops* attach(void*) {
+					return &heap_ops<T, true>::value;
 				}
+				static constexpr job_ops value{ &invoke, nullptr, &destroy, Tokened ? nullptr : &attach, runnable_stack_class<T>::value, false, Tokened };
+			};
 
-				virtual void move_to(void* loc) {
-					to_new_loc(loc, std::move(*this));
+			// Runnables owned by someone else, i.e. the invokees of call.
+			template<typename T, bool Tokened>
+			struct no_own_ops {
+				struct storage_t {
+					T* runnable;
+					std::uint8_t stackClass;
+				};
+				static void invoke(void* storage) {
+					run_runnable(static_cast<storage_t*>(storage)->runnable);
 				}
-				virtual void operator()() {
-					run_runnable(runnable);
+				static const job_ops* attach(void*) {
+					return &no_own_ops<T, true>::value;
 				}
-			private:
-				T* runnable;
+				static constexpr job_ops value{ &invoke, nullptr, nullptr, Tokened ? nullptr : &attach, default_stack_class, true, Tokened };
 			};
 		public:
-			job() {
-				new (padding) job_empty();
+			job()
+				: m_ops(&empty_ops<false>::value) {
 			}
 
 			~job() {
-				get_runnable_base()->~job_base();
+				if (m_ops->destroy)
+					m_ops->destroy(m_storage);
+				if (m_ops->hasToken)
+					token().~dependency_token();
 			}
 
 			job(const job &) = delete;
 			job& operator=(const job &) = delete;
 
 			job(job && other) noexcept {
-				other.get_runnable_base()->move_to(padding);
-				set_dependency_token(std::move(other.get_dependency_token()));
+				take(other);
 			}
 			job& operator=(job && other) noexcept {
-				get_runnable_base()->~job_base();
-				other.get_runnable_base()->move_to(padding);
-				set_dependency_token(std::move(other.get_dependency_token()));
+				if (m_ops->destroy)
+					m_ops->destroy(m_storage);
+				if (m_ops->hasToken) {
+					// Released last, since that can run anything, including code that looks at this job.
+					dependency_token released(std::move(token()));
+					token().~dependency_token();
+					take(other);
+				}
+				else
+					take(other);
 				return *this;
 			}
 
 			template<typename Runnable>
 			job(Runnable&& runnable) {
-				if constexpr(alignof(Runnable) <= NOVA_CACHE_LINE_BYTES && sizeof(job_derived_soo<std::decay_t<Runnable>>) <= paddingSize) {
-					new (padding) job_derived_soo<std::decay_t<Runnable>>(std::forward<Runnable>(runnable));
+				using T = std::decay_t<Runnable>;
+				if constexpr(fits_inline<T>) {
+					new (m_storage) T(std::forward<Runnable>(runnable));
+					m_ops = &inline_ops<T, false>::value;
 				}
 				else {
-					new (padding) job_derived<std::decay_t<Runnable>>(std::forward<Runnable>(runnable));
+#if defined(NOVA_REPORT_SPILLS)
+					report_spill<T, sizeof(T)>();
+#endif
+					*reinterpret_cast<T**>(m_storage) = heap_ops<T, false>::make(std::forward<Runnable>(runnable));
+					m_ops = &heap_ops<T, false>::value;
 				}
 			}
 
 			template<typename Runnable>
-			job(Runnable* runnable) {
-				new (padding) job_derived_no_own<Runnable>(runnable);
+			job(Runnable* runnable)
+				: m_ops(&no_own_ops<Runnable, false>::value) {
+				new (m_storage) typename no_own_ops<Runnable, false>::storage_t{ runnable, default_stack_class };
 			}
 
 			void operator()() {
-				(*get_runnable_base())();
+				m_ops->invoke(m_storage);
+			}
+
+			// The stack size class of the fiber this job must run on. Only jobs that don't own their Runnable (i.e.
+			// the invokees of call) can be given one; everything else gets its class from runnable_stack_class.
+			std::uint8_t stack_class() {
+				return m_ops->storedStackClass ? *stored_stack_class() : m_ops->stackClass;
+			}
+
+			void set_stack_class(std::uint8_t stackClass) {
+				if (m_ops->storedStackClass)
+					*stored_stack_class() = stackClass;
 			}
 
+			// Jobs without a token all share an empty one, which mustn't be changed.
 			dependency_token& get_dependency_token() {
-				return m_dt;
+				if (m_ops->hasToken)
+					return token();
+				static dependency_token none;
+				return none;
 			}
 
+			// Setting an empty token on a job that doesn't have one leaves it without.
 			void set_dependency_token(dependency_token& dt) {
-				m_dt = dt;
+				if (m_ops->hasToken)
+					token() = dt;
+				else if (!is_empty(dt)) {
+					m_ops = m_ops->attach(m_storage);
+					new (&token()) dependency_token(dt);
+				}
 			}
 
 			void set_dependency_token(dependency_token&& dt) {
-				m_dt = std::forward<dependency_token>(dt);
+				if (m_ops->hasToken)
+					token() = std::move(dt);
+				else if (!is_empty(dt)) {
+					m_ops = m_ops->attach(m_storage);
+					new (&token()) dependency_token(std::move(dt));
+				}
 			}
 		private:
-			job_base* get_runnable_base() {
-				return reinterpret_cast<job_base*>(padding);
+			// Leaves other empty, so its destructor has nothing to do.
+			void take(job & other) {
+				m_ops = other.m_ops;
+				if (m_ops->relocate)
+					m_ops->relocate(other.m_storage, m_storage);
+				else
+					std::memcpy(m_storage, other.m_storage, storageSize);
+				if (m_ops->hasToken) {
+					new (&token()) dependency_token(std::move(other.token()));
+					other.token().~dependency_token();
+				}
+				other.m_ops = &empty_ops<false>::value;
+			}
+
+			dependency_token& token() {
+				return *reinterpret_cast<dependency_token*>(m_storage + tokenOffset);
+			}
+
+			std::uint8_t* stored_stack_class() {
+				return m_storage + sizeof(void*);
 			}
 
-			char padding[paddingSize];
-			dependency_token m_dt;
+			alignas(NOVA_CACHE_LINE_BYTES) unsigned char m_storage[storageSize];
+			const job_ops* m_ops;
 		};
+
+		static_assert(NOVA_JOB_BYTES % NOVA_CACHE_LINE_BYTES == 0 && sizeof(job) == NOVA_JOB_BYTES, "NOVA_JOB_BYTES must be a multiple of NOVA_CACHE_LINE_BYTES");
 	}
 
+	// Whether a Runnable is stored in its job rather than allocated, given NOVA_JOB_BYTES. Runnables that are allocated cost a trip
+	// to a spill pool every time they're pushed.
+	template<typename Runnable>
+	struct job_fits_inline {
+		static const bool value = impl::job::fits_inline<std::decay_t<Runnable>>;
+	};
+
+	// The same for Runnables pushed with dependent or co_call, whose jobs also hold a dependency_token.
+	template<typename Runnable>
+	struct job_fits_inline_with_token {
+		static const bool value = impl::job::fits_with_token<std::decay_t<Runnable>>;
+	};
+
+	// Nodes are recycled through a per-thread free list, on whichever thread released the last copy.
 	struct dependency_token::shared_token {
 		shared_token(impl::job & e)
 			: m_job(std::move(e)) {
@@ -350,14 +1200,117 @@ namespace nova {
 
 		~shared_token() {
 			m_job();
+#if NOVA_COROUTINES
+			impl::resume_token_waiters(m_waiters.load(std::memory_order_acquire));
+#endif
+		}
+
+		template <typename Runnable>
+		static shared_token* make(Runnable&& runnable) {
+			free_list& list = free_tokens();
+			void* node = list.head;
+			if (node) {
+				list.head = list.head->next;
+				list.count--;
+			}
+			else
+				node = ::operator new(sizeof(shared_token), std::align_val_t(alignof(shared_token)));
+			return new (node) shared_token(std::forward<Runnable>(runnable));
+		}
+
+		// Drops a copy's reference, and runs the Runnable if it was the last one.
+		static void release(shared_token* token) {
+			if (!token || token->m_refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+				return;
+			token->~shared_token();
+			// Looked up afterwards, since the Runnable can move this fiber to another thread.
+			free_list& list = free_tokens();
+			if (list.count < cache_size) {
+				free_node* node = reinterpret_cast<free_node*>(token);
+				node->next = list.head;
+				list.head = node;
+				list.count++;
+			}
+			else
+				deallocate(token);
 		}
 
 		impl::job m_job;
+		std::atomic<std::size_t> m_refs{ 1 };
+#if NOVA_COROUTINES
+		std::atomic<impl::token_waiter*> m_waiters{ nullptr };
+#endif
+	private:
+		static const std::size_t cache_size = 1024;
+
+		struct free_node {
+			free_node* next;
+		};
+
+		struct free_list {
+			~free_list() {
+				while (head) {
+					free_node* node = head;
+					head = head->next;
+					deallocate(node);
+				}
+			}
+			free_node* head = nullptr;
+			std::size_t count = 0;
+		};
+
+		NOVA_NOINLINE static free_list & free_tokens() {
+			static thread_local free_list list;
+			return list;
+		}
+
+		static void deallocate(void* node) {
+			::operator delete(node, std::align_val_t(alignof(shared_token)));
+		}
 	};
 
 	template<typename Runnable, std::enable_if_t<!std::is_same<std::decay_t<Runnable>, dependency_token>::value, int>>
 	dependency_token::dependency_token(Runnable&& runnable)
-		: m_token(std::make_shared<shared_token>(std::forward<Runnable>(runnable))) {
+		: m_token(shared_token::make(std::forward<Runnable>(runnable))) {
+	}
+
+	inline dependency_token::dependency_token(const dependency_token & other)
+		: m_token(other.m_token) {
+		if (m_token)
+			m_token->m_refs.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	// Assigning releases the old node last, once this token is in a consistent state, since that can run anything.
+	inline dependency_token& dependency_token::operator=(const dependency_token& other) {
+		shared_token* old = m_token;
+		m_token = other.m_token;
+		if (m_token)
+			m_token->m_refs.fetch_add(1, std::memory_order_relaxed);
+		shared_token::release(old);
+		return *this;
+	}
+
+	inline dependency_token& dependency_token::operator=(dependency_token&& other) noexcept {
+		if (this != &other) {
+			shared_token* old = m_token;
+			m_token = other.m_token;
+			other.m_token = nullptr;
+			shared_token::release(old);
+		}
+		return *this;
+	}
+
+	inline void dependency_token::Release() {
+		shared_token* old = m_token;
+		m_token = nullptr;
+		shared_token::release(old);
+	}
+
+	namespace impl {
+		// No other copy can appear once this is true, since copies are only made from existing ones.
+		inline bool is_last_copy(const dependency_token& dt) {
+			return dt.m_token && dt.m_token->m_refs.load(std::memory_order_acquire) == 1;
+		}
 	}
 
 #pragma endregion
@@ -365,60 +1318,287 @@ namespace nova {
 #pragma region resources
 
 	namespace impl {
-		class resources {
+		// Idle fibers that have overflowed a thread's cache, kept as linked batches of NOVA_FIBER_BATCH_SIZE in a
+		// lock-free queue per stack size class. Threads that run dry take a batch back, so fibers freed on one thread
+		// are reused by others instead of piling up while another thread creates new ones.
+		class fiber_depot {
 		public:
-			// Meyers singletons			
-			static std::vector<LPVOID>& available_fibers() {
-				static thread_local std::vector<LPVOID> af;
-				return af;
+			struct counters_t {
+				std::atomic<std::size_t> created{ 0 };
+				std::atomic<std::size_t> prewarmed{ 0 };
+				std::atomic<std::size_t> depotFibers{ 0 };
+				std::atomic<std::size_t> trimmedFibers{ 0 };
+				std::atomic<std::size_t> trimmedBytes{ 0 };
+			};
+
+			static void push(std::uint8_t stackClass, fiber* batch) {
+				push(stackClass, { batch, std::chrono::steady_clock::now(), false });
+				counters().depotFibers.fetch_add(NOVA_FIBER_BATCH_SIZE, std::memory_order_relaxed);
 			}
-			static void delete_fiber_pool() {
-				auto available = available_fibers();
-				for (LPVOID fiber_id : available)
-					DeleteFiber(fiber_id);
+
+			static fiber* pop(std::uint8_t stackClass) {
+				batch b;
+				if (!pop(stackClass, b))
+					return nullptr;
+				counters().depotFibers.fetch_sub(NOVA_FIBER_BATCH_SIZE, std::memory_order_relaxed);
+				return b.head;
 			}
-			static dependency_token *& call_token() {
-				static thread_local dependency_token * ct;
-				return ct;
+
+			// Releases the stacks of batches that have been idle for at least the given age. Each batch is only released
+			// once; the pages come back as soon as a thread takes the batch and uses the fibers.
+			static void trim(std::chrono::steady_clock::duration age) {
+				std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+				std::vector<batch> batches;
+				for (std::uint8_t c = 0; c < stack_class_count; c++) {
+					batches.resize(instance().m_batches[c].size_approx());
+					batches.resize(instance().m_batches[c].try_dequeue_bulk(batches.begin(), batches.size()));
+					for (batch& b : batches) {
+						if (!b.trimmed && now - b.idleSince >= age) {
+#if defined(_WIN32)
+							// Win32 can't decommit part of a fiber's stack, so idle fibers are deleted instead.
+							counters().depotFibers.fetch_sub(NOVA_FIBER_BATCH_SIZE, std::memory_order_relaxed);
+							counters().trimmedFibers.fetch_add(NOVA_FIBER_BATCH_SIZE, std::memory_order_relaxed);
+							counters().trimmedBytes.fetch_add(NOVA_FIBER_BATCH_SIZE * stack_class_size(c), std::memory_order_relaxed);
+							delete_batch(b.head);
+							continue;
+#else
+							std::size_t bytes = 0;
+							for (fiber* f = b.head; f; f = f->next())
+								bytes += f->trim();
+							counters().trimmedFibers.fetch_add(NOVA_FIBER_BATCH_SIZE, std::memory_order_relaxed);
+							counters().trimmedBytes.fetch_add(bytes, std::memory_order_relaxed);
+							b.trimmed = true;
+#endif
+						}
+						push(c, b);
+					}
+				}
 			}
-			static dependency_token *& dependent_token() {
-				static thread_local dependency_token * se;
-				return se;
-			}	
-			static LPVOID & initial_fiber() {
-				static thread_local LPVOID ifib = NULL;
-				return ifib;
+
+			static void delete_fibers() {
+				for (std::uint8_t c = 0; c < stack_class_count; c++) {
+					while (fiber* head = pop(c))
+						delete_batch(head);
+				}
 			}
 
-			static bool & should_release_call_token() {
-				static thread_local bool srct = true;
-				return srct;
+			static counters_t& counters() {
+				static counters_t ct;
+				return ct;
 			}
-		};
-	}
+		private:
+			struct batch {
+				fiber* head;
+				std::chrono::steady_clock::time_point idleSince;
+				bool trimmed;
+			};
 
-#pragma endregion
+			static void push(std::uint8_t stackClass, const batch& b) {
+				instance().m_batches[stackClass].enqueue(b);
+			}
 
-#pragma region queue_wrapper
+			static bool pop(std::uint8_t stackClass, batch& b) {
+				return instance().m_batches[stackClass].try_dequeue(b);
+			}
 
-	namespace impl{
-		class critical_lock {
-		public:
-			critical_lock(CRITICAL_SECTION& cs) : m_cs(cs) {
-				EnterCriticalSection(&m_cs);
+			static void delete_batch(fiber* head) {
+				while (head) {
+					fiber* next = head->next();
+					fiber::destroy(head);
+					head = next;
+				}
 			}
 
-			~critical_lock() {
-				LeaveCriticalSection(&m_cs);
+			static fiber_depot& instance() {
+				static fiber_depot fd;
+				return fd;
 			}
 
-		private:
-			critical_lock(const critical_lock&) = delete;
+			std::array<::moodycamel::ConcurrentQueue<batch>, stack_class_count> m_batches;
+		};
+
+		// Background thread that periodically trims the fiber depot.
+		class fiber_trimmer {
+		public:
+			fiber_trimmer(std::chrono::milliseconds age) {
+				if (age.count() > 0)
+					m_thread = std::thread(&fiber_trimmer::run, this, age);
+			}
+
+			~fiber_trimmer() {
+				stop();
+			}
 
+			void stop() {
+				if (!m_thread.joinable())
+					return;
+				{
+					std::lock_guard<std::mutex> lock(m_lock);
+					m_stop = true;
+				}
+				m_wake.notify_one();
+				m_thread.join();
+			}
 		private:
-			CRITICAL_SECTION & m_cs;
+			void run(std::chrono::milliseconds age) {
+				std::chrono::milliseconds period = (std::max)(age / 2, std::chrono::milliseconds(1));
+				std::unique_lock<std::mutex> lock(m_lock);
+				while (!m_wake.wait_for(lock, period, [this]() { return m_stop; }))
+					fiber_depot::trim(age);
+			}
+
+			std::mutex m_lock;
+			std::condition_variable m_wake;
+			bool m_stop = false;
+			std::thread m_thread;
+		};
+
+		class resources {
+		public:
+			// Meyers singletons			
+			// Idle fibers cached by this thread, one free list per stack size class.
+			NOVA_NOINLINE static std::vector<fiber*>& available_fibers(std::uint8_t stackClass) {
+				static thread_local std::array<std::vector<fiber*>, stack_class_count> af;
+				return af[pool_class(stackClass)];
+			}
+			// Returns an idle fiber of the given class from this thread's cache or the depot, or nullptr if there are none.
+			static fiber* acquire_fiber(std::uint8_t stackClass) {
+				std::vector<fiber*>& available = available_fibers(stackClass);
+				if (available.empty()) {
+					for (fiber* f = fiber_depot::pop(pool_class(stackClass)); f; f = f->next())
+						available.push_back(f);
+					if (available.empty())
+						return nullptr;
+				}
+				fiber* f = available.back();
+				available.pop_back();
+				return f;
+			}
+			// Caches an idle fiber, moving a batch to the depot if the cache is full. Callers release their own fiber just
+			// before switching away from it, so f may still be running; the batch is taken from the oldest end of the cache,
+			// where every fiber has already been switched away from, so no other thread can pick up a live stack.
+			static void release_fiber(fiber* f) {
+				std::vector<fiber*>& available = available_fibers(f->stack_class());
+				available.push_back(f);
+				if (available.size() >= 2 * NOVA_FIBER_BATCH_SIZE) {
+					fiber* batch = nullptr;
+					for (std::size_t c = 0; c < NOVA_FIBER_BATCH_SIZE; c++) {
+						available[c]->next() = batch;
+						batch = available[c];
+					}
+					available.erase(available.begin(), available.begin() + NOVA_FIBER_BATCH_SIZE);
+					fiber_depot::push(pool_class(f->stack_class()), batch);
+				}
+			}
+			// Fills this thread's cache with new fibers of the default class, overflowing into the depot.
+			static void prewarm_fiber_pool() {
+				for (std::size_t c = 0; c < prewarm_fibers(); c++)
+					release_fiber(create_fiber(default_stack_class()));
+				fiber_depot::counters().prewarmed.fetch_add(prewarm_fibers(), std::memory_order_relaxed);
+			}
+			static fiber* create_fiber(std::uint8_t stackClass);
+			// Releases the stacks of the fibers in this thread's cache, like fiber_depot::trim does for the depot. Only the
+			// thread itself can touch its cache, so it does this once it has been idle for fiber_trim_age.
+			static void trim_fiber_cache() {
+				std::size_t fibers = 0;
+				std::size_t bytes = 0;
+				for (std::uint8_t c = 0; c < stack_class_count; c++) {
+					std::vector<fiber*>& available = available_fibers(c);
+					fibers += available.size();
+#if defined(_WIN32)
+					// As in the depot, idle Win32 fibers are deleted instead.
+					bytes += available.size() * stack_class_size(c);
+					for (fiber* f : available)
+						fiber::destroy(f);
+					available.clear();
+#else
+					for (fiber* f : available)
+						bytes += f->trim();
+#endif
+				}
+				fiber_depot::counters().trimmedFibers.fetch_add(fibers, std::memory_order_relaxed);
+				fiber_depot::counters().trimmedBytes.fetch_add(bytes, std::memory_order_relaxed);
+			}
+			static void delete_fiber_pool() {
+				for (std::uint8_t c = 0; c < stack_class_count; c++) {
+					std::vector<fiber*>& available = available_fibers(c);
+					for (fiber* f : available)
+						fiber::destroy(f);
+					available.clear();
+				}
+			}
+			NOVA_NOINLINE static dependency_token *& call_token() {
+				static thread_local dependency_token * ct;
+				return ct;
+			}
+			NOVA_NOINLINE static dependency_token *& dependent_token() {
+				static thread_local dependency_token * se;
+				return se;
+			}	
+			// Set while a worker drops the token of a job it just ran. A call that the release completes is left here
+			// rather than queued, so the worker can switch straight to it. See worker_thread::release_job.
+			NOVA_NOINLINE static fiber **& resume_slot() {
+				static thread_local fiber ** rs = nullptr;
+				return rs;
+			}
+			// Job handed to the next fiber when the current one can't run it. See worker_thread::hand_off.
+			NOVA_NOINLINE static job *& handoff_job() {
+				static thread_local job * hj = nullptr;
+				return hj;
+			}
+			NOVA_NOINLINE static fiber *& initial_fiber() {
+				static thread_local fiber * ifib = nullptr;
+				return ifib;
+			}
+
+			NOVA_NOINLINE static bool & should_release_call_token() {
+				static thread_local bool srct = true;
+				return srct;
+			}
+
+			// Stack size class of fibers running jobs that didn't ask for one, set by the start functions.
+			static std::uint8_t & default_stack_class() {
+				static std::uint8_t dsc = stack_class_for(NOVA_FIBER_STACK_BYTES);
+				return dsc;
+			}
+
+			// How long a thread's cached fibers and the depot's batches stay idle before their stacks are released, set by the
+			// start functions. Zero never releases them.
+			static std::chrono::steady_clock::duration & fiber_trim_age() {
+				static std::chrono::steady_clock::duration fta{ 0 };
+				return fta;
+			}
+
+			// Number of fibers each thread creates before entering the job loop, set by the start functions.
+			static std::size_t & prewarm_fibers() {
+				static std::size_t pf = 0;
+				return pf;
+			}
+
+			static std::uint8_t resolve_stack_class(std::uint8_t stackClass) {
+				return stackClass == impl::default_stack_class ? default_stack_class() : stackClass;
+			}
+
+			// Threads converted to fibers share the default class's pool.
+			static std::uint8_t pool_class(std::uint8_t stackClass) {
+				return stackClass < stack_class_count ? stackClass : default_stack_class();
+			}
+
+			// Returns cached fiber stacks to the system; there's nothing to release with Win32 fibers.
+			static void release_stack_cache() {
+#if !defined(_WIN32)
+				stack_allocator::release_cache();
+#endif
+			}
 		};
+	}
+
+#pragma endregion
+
+#pragma region queue_wrapper
 
+	namespace impl{
+#if defined(_WIN32)
 		class critical_wrapper {
 		public:
 			critical_wrapper() {
@@ -429,6 +1609,14 @@ namespace nova {
 				DeleteCriticalSection(&cs);
 			}
 
+			void lock() {
+				EnterCriticalSection(&cs);
+			}
+
+			void unlock() {
+				LeaveCriticalSection(&cs);
+			}
+
 			operator CRITICAL_SECTION&() {
 				return cs;
 			}
@@ -437,21 +1625,287 @@ namespace nova {
 			CRITICAL_SECTION cs;
 		}; 
 
-		class condition_wrapper {
+		// Tells the core this is a spin-wait, so it can back off and let a sibling hyperthread run.
+		inline void cpu_relax() {
+			YieldProcessor();
+		}
+
+		// Blocks while the word still holds the given value. May return spuriously.
+		inline void wait_on_address(std::atomic<std::uint32_t>& word, std::uint32_t value) {
+			WaitOnAddress(&word, &value, sizeof(value), INFINITE);
+		}
+
+		inline void wait_on_address(std::atomic<std::uint32_t>& word, std::uint32_t value, std::chrono::nanoseconds timeout) {
+			DWORD ms = static_cast<DWORD>((std::max)(std::chrono::ceil<std::chrono::milliseconds>(timeout).count(), static_cast<long long>(1)));
+			WaitOnAddress(&word, &value, sizeof(value), ms);
+		}
+
+		inline void wake_address(std::atomic<std::uint32_t>& word, std::uint32_t count) {
+			for (std::uint32_t i = 0; i < count; i++)
+				WakeByAddressSingle(&word);
+		}
+#else
+		class critical_wrapper {
 		public:
-			condition_wrapper() {
-				InitializeConditionVariable(&cv);
+			void lock() {
+				m.lock();
 			}
 
-			operator CONDITION_VARIABLE&() {
-				return cv;
+			void unlock() {
+				m.unlock();
 			}
+
 		private:
+			std::mutex m;
+		};
+
+		// Tells the core this is a spin-wait, so it can back off and let a sibling hyperthread run.
+		inline void cpu_relax() {
+#if defined(__x86_64__)
+			__builtin_ia32_pause();
+#else
+			__asm__ __volatile__("yield");
+#endif
+		}
+
+		// Blocks while the word still holds the given value. May return spuriously.
+		inline void wait_on_address(std::atomic<std::uint32_t>& word, std::uint32_t value) {
+			syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(&word), FUTEX_WAIT_PRIVATE, value, nullptr, nullptr, 0);
+		}
+
+		inline void wait_on_address(std::atomic<std::uint32_t>& word, std::uint32_t value, std::chrono::nanoseconds timeout) {
+			timespec ts;
+			ts.tv_sec = static_cast<time_t>(timeout.count() / 1000000000);
+			ts.tv_nsec = static_cast<long>(timeout.count() % 1000000000);
+			syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(&word), FUTEX_WAIT_PRIVATE, value, &ts, nullptr, 0);
+		}
+
+		inline void wake_address(std::atomic<std::uint32_t>& word, std::uint32_t count) {
+			syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(&word), FUTEX_WAKE_PRIVATE, static_cast<int>((std::min)(count, static_cast<std::uint32_t>(INT32_MAX))), nullptr, nullptr, 0);
+		}
+#endif
 
-			CONDITION_VARIABLE cv;
+		// Lets idle threads sleep until work shows up without a lock on the push path. A thread that wants to sleep announces
+		// itself with prepare_wait, checks for work once more, then either cancels or commits. Pushers only make a system call
+		// when someone has announced, and the epoch makes sure a push that lands between the check and the sleep isn't missed.
+		class event_count {
+		public:
+			std::uint32_t prepare_wait() {
+				m_waiters.fetch_add(1, std::memory_order_seq_cst);
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				return m_epoch.load(std::memory_order_acquire);
+			}
+
+			void cancel_wait() {
+				m_waiters.fetch_sub(1, std::memory_order_relaxed);
+			}
+
+			void commit_wait(std::uint32_t key) {
+				while (m_epoch.load(std::memory_order_acquire) == key)
+					wait_on_address(m_epoch, key);
+				m_waiters.fetch_sub(1, std::memory_order_relaxed);
+			}
+
+			// Like commit_wait, but gives up after the timeout. May also return early, like any wakeup.
+			void commit_wait_for(std::uint32_t key, std::chrono::nanoseconds timeout) {
+				if (m_epoch.load(std::memory_order_acquire) == key)
+					wait_on_address(m_epoch, key, timeout);
+				m_waiters.fetch_sub(1, std::memory_order_relaxed);
+			}
+
+			// Wakes up to count sleepers, never more than there are. Must be called after the work is published.
+			void notify(std::uint32_t count = 1) {
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				std::uint32_t waiters = m_waiters.load(std::memory_order_relaxed);
+				if (!waiters)
+					return;
+				m_epoch.fetch_add(1, std::memory_order_release);
+				wake_address(m_epoch, (std::min)(count, waiters));
+			}
+		private:
+			alignas(NOVA_CACHE_LINE_BYTES) std::atomic<std::uint32_t> m_epoch{ 0 };
+			alignas(NOVA_CACHE_LINE_BYTES) std::atomic<std::uint32_t> m_waiters{ 0 };
+		};
+
+		class critical_lock {
+		public:
+			critical_lock(critical_wrapper& cs) : m_cs(cs) {
+				m_cs.lock();
+			}
+
+			~critical_lock() {
+				m_cs.unlock();
+			}
+
+		private:
+			critical_lock(const critical_lock&) = delete;
+
+		private:
+			critical_wrapper & m_cs;
 		};
 
 		typedef ::nova::impl::job queue_item_t;
+
+		// Heap copies of jobs for places that hand jobs between threads by pointer. Freed nodes are kept in a per-thread
+		// cache, whichever thread made them.
+		class job_node {
+		public:
+			static queue_item_t* make(queue_item_t&& item) {
+				std::vector<void*>& cache = nodes().nodes;
+				void* node;
+				if (cache.empty()) {
+					node = ::operator new(sizeof(queue_item_t), std::align_val_t(alignof(queue_item_t)));
+				}
+				else {
+					node = cache.back();
+					cache.pop_back();
+				}
+				return new (node) queue_item_t(std::move(item));
+			}
+
+			static void free(queue_item_t* node) {
+				node->~queue_item_t();
+				std::vector<void*>& cache = nodes().nodes;
+				if (cache.size() < cache_size)
+					cache.push_back(node);
+				else
+					deallocate(node);
+			}
+
+			// Moves the job out of a node and recycles the node.
+			static void take(queue_item_t* node, queue_item_t& item) {
+				item = std::move(*node);
+				free(node);
+			}
+		private:
+			static const std::size_t cache_size = 1024;
+
+			struct cache {
+				~cache() {
+					for (void* node : nodes)
+						deallocate(node);
+				}
+				std::vector<void*> nodes;
+			};
+
+			NOVA_NOINLINE static cache & nodes() {
+				static thread_local cache c;
+				return c;
+			}
+
+			static void deallocate(void* node) {
+				::operator delete(node, std::align_val_t(alignof(queue_item_t)));
+			}
+		};
+
+		// Chase-Lev deque of jobs owned by one worker (Le et al., "Correct and Efficient Work-Stealing for Weak Memory
+		// Models"). The owner pushes and pops at the bottom, LIFO, and other workers steal from the top, FIFO. Jobs
+		// aren't safe to copy speculatively the way a thief would, so the deque holds job nodes.
+		class work_stealing_deque {
+		public:
+			work_stealing_deque()
+				: m_ring(new ring(initial_capacity)) {
+			}
+
+			~work_stealing_deque() {
+				while (queue_item_t* item = pop())
+					job_node::free(item);
+				for (ring* r : m_retired)
+					delete r;
+				delete m_ring.load(std::memory_order_relaxed);
+			}
+
+			work_stealing_deque(const work_stealing_deque&) = delete;
+			work_stealing_deque& operator=(const work_stealing_deque&) = delete;
+
+			// Owner only.
+			void push(queue_item_t&& item) {
+				queue_item_t* node = job_node::make(std::move(item));
+				std::int64_t b = m_bottom.load(std::memory_order_relaxed);
+				std::int64_t t = m_top.load(std::memory_order_acquire);
+				ring* r = m_ring.load(std::memory_order_relaxed);
+				if (b - t > r->mask) {
+					//Thieves may still be reading the old ring, so it's kept until the deque goes away
+					m_retired.push_back(r);
+					r = r->grow(t, b);
+					m_ring.store(r, std::memory_order_release);
+				}
+				r->put(b, node);
+				std::atomic_thread_fence(std::memory_order_release);
+				m_bottom.store(b + 1, std::memory_order_relaxed);
+			}
+
+			// Owner only. Returns null if the deque is empty.
+			queue_item_t* pop() {
+				std::int64_t b = m_bottom.load(std::memory_order_relaxed) - 1;
+				ring* r = m_ring.load(std::memory_order_relaxed);
+				m_bottom.store(b, std::memory_order_relaxed);
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				std::int64_t t = m_top.load(std::memory_order_relaxed);
+				if (t > b) {
+					m_bottom.store(b + 1, std::memory_order_relaxed);
+					return nullptr;
+				}
+				queue_item_t* item = r->get(b);
+				if (t == b) {
+					//Last item; race the thieves for it
+					if (!m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+						item = nullptr;
+					m_bottom.store(b + 1, std::memory_order_relaxed);
+				}
+				return item;
+			}
+
+			// Any thread. Only a hint while the owner or thieves are active.
+			std::size_t size_approx() const {
+				std::int64_t b = m_bottom.load(std::memory_order_relaxed);
+				std::int64_t t = m_top.load(std::memory_order_relaxed);
+				return b > t ? static_cast<std::size_t>(b - t) : 0;
+			}
+
+			// Any thread. Returns null if the deque is empty or another thread got there first.
+			queue_item_t* steal() {
+				std::int64_t t = m_top.load(std::memory_order_acquire);
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				std::int64_t b = m_bottom.load(std::memory_order_acquire);
+				if (t >= b)
+					return nullptr;
+				queue_item_t* item = m_ring.load(std::memory_order_acquire)->get(t);
+				if (!m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+					return nullptr;
+				return item;
+			}
+
+		private:
+			static const std::int64_t initial_capacity = 256;
+
+			struct ring {
+				explicit ring(std::int64_t capacity)
+					: mask(capacity - 1), slots(new std::atomic<queue_item_t*>[capacity]) {
+				}
+
+				queue_item_t* get(std::int64_t i) const {
+					return slots[i & mask].load(std::memory_order_relaxed);
+				}
+				void put(std::int64_t i, queue_item_t* item) {
+					slots[i & mask].store(item, std::memory_order_relaxed);
+				}
+				ring* grow(std::int64_t top, std::int64_t bottom) const {
+					ring* r = new ring((mask + 1) * 2);
+					for (std::int64_t i = top; i < bottom; i++)
+						r->put(i, get(i));
+					return r;
+				}
+
+				std::int64_t mask;
+				std::unique_ptr<std::atomic<queue_item_t*>[]> slots;
+			};
+
+			alignas(NOVA_CACHE_LINE_BYTES) std::atomic<std::int64_t> m_top{ 0 };
+			alignas(NOVA_CACHE_LINE_BYTES) std::atomic<std::int64_t> m_bottom{ 0 };
+			std::atomic<ring*> m_ring;
+			std::vector<ring*> m_retired;
+		};
 		
 		class moodycamel_adaptor {
 		public:
@@ -468,27 +1922,156 @@ namespace nova {
 				m_queue.enqueue(qd.pt, std::forward<queue_item_t>(item));
 			}
 
-			template<std::size_t N>
-			void push(queue_data& qd, std::array<queue_item_t, N> && items) {
-				m_queue.enqueue_bulk(qd.pt, std::make_move_iterator(std::begin(items)), items.size());
-			}
-
-			void push(queue_data& qd, std::vector<queue_item_t> && items) {
-				m_queue.enqueue_bulk(qd.pt, std::make_move_iterator(std::begin(items)), items.size());
+			void push(queue_data& qd, queue_item_t* items, std::size_t count) {
+				m_queue.enqueue_bulk(qd.pt, std::make_move_iterator(items), count);
 			}
 
 			queue_data make_queue_data() {
 				return { ::moodycamel::ConsumerToken(m_queue), ::moodycamel::ProducerToken(m_queue) };
 			}
+
+			std::size_t size_approx() const {
+				return m_queue.size_approx();
+			}
 		private:
 			::moodycamel::ConcurrentQueue<queue_item_t> m_queue;
 		};
 
+		// Holds the job a thread pushed most recently by itself, which the thread runs next while its inputs are still in cache.
+		// Other threads only take it once they've been idle for a while.
+		class next_slot {
+		public:
+			next_slot() = default;
+			~next_slot() {
+				if (queue_item_t* node = m_node.exchange(nullptr, std::memory_order_acquire))
+					job_node::free(node);
+			}
+
+			next_slot(const next_slot&) = delete;
+			next_slot& operator=(const next_slot&) = delete;
+
+			// Returns the node the new one displaced, if any.
+			queue_item_t* exchange(queue_item_t* node) {
+				return m_node.exchange(node, std::memory_order_acq_rel);
+			}
+			queue_item_t* take() {
+				if (!m_node.load(std::memory_order_relaxed))
+					return nullptr;
+				return m_node.exchange(nullptr, std::memory_order_acquire);
+			}
+		private:
+			std::atomic<queue_item_t*> m_node{ nullptr };
+		};
+
+		// Jobs addressed to one thread with to_thread or to_main. Any thread can push, only the owner pops.
+		class inbox {
+		public:
+			inbox() = default;
+			inbox(const inbox&) = delete;
+			inbox& operator=(const inbox&) = delete;
+
+			void push(queue_item_t&& item) {
+				m_queue.enqueue(std::forward<queue_item_t>(item));
+				m_empty.store(false, std::memory_order_release);
+			}
+
+			void push(queue_item_t* items, std::size_t count) {
+				m_queue.enqueue_bulk(std::make_move_iterator(items), count);
+				m_empty.store(false, std::memory_order_release);
+			}
+
+			// Skips the dequeue while the inbox is known to be empty.
+			bool pop(queue_item_t& item) {
+				bool exp = false;
+				if (m_empty.compare_exchange_strong(exp, true, std::memory_order_acquire) && m_queue.try_dequeue(m_ct, item)) {
+					m_empty.store(false, std::memory_order_relaxed);
+					return true;
+				}
+				return false;
+			}
+
+			// Resumptions of return_same callers, kept apart from the jobs that have to run on the owner, since other threads
+			// can take them once the owner has been busy too long.
+			void push_resume(queue_item_t&& item) {
+				m_resumes.enqueue(std::forward<queue_item_t>(item));
+			}
+
+			bool pop_resume(queue_item_t& item) {
+				return m_resumes.try_dequeue(m_resumesCt, item);
+			}
+
+			// For threads other than the owner.
+			bool steal_resume(queue_item_t& item) {
+				return m_resumes.try_dequeue(item);
+			}
+
+			// The owner, if it isn't the main thread, sleeps on this, so a push can wake just the thread it's meant for.
+			event_count wake;
+			// Set while the owner, if it isn't the main thread, is parking or parked on wake. Whoever clears it wakes the owner.
+			std::atomic_bool parked{ false };
+			// When the owner popped the job it's running, or zero while it's looking for one.
+			std::atomic<std::chrono::steady_clock::rep> busySince{ 0 };
+		private:
+			::moodycamel::ConcurrentQueue<queue_item_t> m_queue;
+			::moodycamel::ConsumerToken m_ct{ m_queue };
+			std::atomic_bool m_empty{ true };
+			::moodycamel::ConcurrentQueue<queue_item_t> m_resumes;
+			::moodycamel::ConsumerToken m_resumesCt{ m_resumes };
+		};
+
+		// Target of controls that don't send Runnables or callers to a particular thread.
+		static constexpr std::size_t any_thread = SIZE_MAX;
+		// Target of return_same, which is only known once the call is made.
+		static constexpr std::size_t same_thread = SIZE_MAX - 1;
+		// numa_node<Node> is passed down as the target thread first_node_target + Node.
+		static constexpr std::size_t first_node_target = SIZE_MAX / 2;
+
 		class queue_wrapper {
 		public:
 			struct thread_data {
-				moodycamel_adaptor::queue_data globalData;
-				moodycamel_adaptor::queue_data mainData;
+				// One per priority level.
+				std::vector<moodycamel_adaptor::queue_data> globalData;
+				// One per domain after the first, whose queue is the default level's global queue.
+				std::vector<moodycamel_adaptor::queue_data> domainData;
+				// Set when the thread is registered.
+				inbox* mail;
+				std::size_t id;
+				std::size_t domain;
+				std::unique_ptr<next_slot> next;
+				// Only there when work stealing is on.
+				std::unique_ptr<work_stealing_deque> deque;
+				// Pause instructions this thread spends looking for work before it parks.
+				unsigned spinBudget;
+				// Jobs popped since the last aging turn, and the level that turn started at.
+				unsigned pops = 0;
+				std::uint8_t agedLevel = 0;
+			};
+
+			// Threads a thief tries together, see thread_layout.
+			struct victim_tier {
+				std::vector<std::size_t> threads;
+				// Whether they share a cache with the thief.
+				bool sharedCache;
+			};
+
+			// Where a run's threads are, worked out from the CPUs they're pinned to.
+			struct thread_layout {
+				std::size_t domainCount = 1;
+				// NUMA domain of each thread id.
+				std::vector<std::size_t> domains;
+				// For each thread id, the other threads grouped by the closest cache level they share with it, closest first.
+				std::vector<std::vector<victim_tier>> victims;
+			};
+
+			// Where return_same calls were resumed, whose deques steals came from, and which threads couldn't be pinned.
+			struct counters_t {
+				std::atomic<std::size_t> completedInline{ 0 };
+				std::atomic<std::size_t> resumedDirectly{ 0 };
+				std::atomic<std::size_t> resumedViaInbox{ 0 };
+				std::atomic<std::size_t> resumedElsewhere{ 0 };
+				std::atomic<std::size_t> localSteals{ 0 };
+				std::atomic<std::size_t> remoteSteals{ 0 };
+				std::atomic<std::size_t> unpinnedThreads{ 0 };
 			};
 
 			queue_wrapper(const queue_wrapper& other) = delete;
@@ -496,7 +2079,7 @@ namespace nova {
 			queue_wrapper(queue_wrapper&& other) = delete;
 			queue_wrapper& operator=(queue_wrapper&& other) = delete;
 
-			static thread_data *& current_thread_data() {
+			NOVA_NOINLINE static thread_data *& current_thread_data() {
 				static thread_local thread_data * td;
 				return td;
 			}
@@ -506,108 +2089,801 @@ namespace nova {
 				return qw;
 			}
 
+			static counters_t& counters() {
+				static counters_t ct;
+				return ct;
+			}
+
 			void pop(queue_item_t& item) {
-				unsigned counter = 0;
-				while (!m_globalQueue.pop(current_thread_data()->globalData, item)) {
-					if (counter++ > NOVA_SPIN_COUNT) {
-						counter = 0;
-						SleepConditionVariableCS(&global_condition_variable(), &dummy_critical_section(), INFINITE);
-					}
-				}
+				pop<false>(item, current_thread_data()->mail->wake);
 			}
 
 			void pop_main(queue_item_t& item) {
-				unsigned counter = 0;
-				while (!try_pop_main_queue(item) && !m_globalQueue.pop(current_thread_data()->globalData, item)) {
-					if (counter++ > NOVA_SPIN_COUNT) {
-						counter = 0;
-						SleepConditionVariableCS(&main_condition_variable(), &dummy_critical_section(), INFINITE);
-					}
-				}
+				pop<true>(item, main_event());
 			}
 
-			template<bool ToMain>
+			// Jobs with a priority other than the default skip the next slot and deques and go to their level's global queue.
+			// Jobs for a particular thread go through its inbox, and jobs for a NUMA node through its domain's queue, whatever
+			// their priority. Thread ids and nodes past the end wrap around.
+			template<std::size_t ToThread, std::uint8_t Priority = NOVA_DEFAULT_PRIORITY>
 			void push(queue_item_t&& item) {
-				if constexpr(ToMain) {
-					m_mainQueue.push(current_thread_data()->mainData, std::forward<queue_item_t>(item));
-					is_main_queue_empty.store(false, std::memory_order_relaxed);
-					WakeConditionVariable(&main_condition_variable());
+				if constexpr(ToThread >= first_node_target && ToThread != any_thread) {
+					std::size_t domain = (ToThread - first_node_target) % m_domainCount;
+					domain_queue(domain).push(domain_data(domain), std::forward<queue_item_t>(item));
+					notify_workers();
+					main_event().notify();
+				}
+				else if constexpr(ToThread != any_thread) {
+					push_inbox(ToThread, std::forward<queue_item_t>(item));
 				}
 				else {
-					m_globalQueue.push(current_thread_data()->globalData, std::forward<queue_item_t>(item));
-					WakeConditionVariable(&global_condition_variable());
-					WakeConditionVariable(&main_condition_variable());
+					if constexpr(Priority == NOVA_DEFAULT_PRIORITY)
+						push_shared(std::forward<queue_item_t>(item));
+					else
+						m_globalQueues[Priority].push(current_thread_data()->globalData[Priority], std::forward<queue_item_t>(item));
+					notify_workers();
+					main_event().notify();
 				}
 			}
 
-			template<bool ToMain, typename Collection>
-			void push(Collection && items) {
-				if constexpr(ToMain) {
-					m_mainQueue.push(current_thread_data()->mainData, std::forward<decltype(items)>(items));
-					is_main_queue_empty.store(false, std::memory_order_relaxed);
-					WakeConditionVariable(&main_condition_variable());
+			void push_inbox(std::size_t threadId, queue_item_t&& item) {
+				std::size_t target = threadId % m_threadCount;
+				m_inboxes[target]->push(std::forward<queue_item_t>(item));
+				notify_inbox(target);
+			}
+
+			// Queues a return_same caller's resumption for the thread it was called from. If that thread is still busy with one
+			// job return_same_wait after it started it, any other thread can take the resumption instead. The first one
+			// outstanding wakes a sleeper, so there's a thread around to notice.
+			void push_resume(std::size_t threadId, queue_item_t&& item) {
+				std::size_t target = threadId % m_threadCount;
+				m_inboxes[target]->push_resume(std::forward<queue_item_t>(item));
+				if (m_pendingResumes.fetch_add(1, std::memory_order_seq_cst) == 0) {
+					notify_workers();
+					main_event().notify();
+				}
+				notify_inbox(target);
+			}
+
+			// Whether the current thread is pinned to the given NUMA node. Nodes past the end wrap around.
+			bool is_in_domain(std::size_t node) {
+				return current_thread_data()->domain == node % m_domainCount;
+			}
+
+			// Restarts the current thread's busy clock, for a thread that goes on to something else without popping a job.
+			void mark_busy() {
+				current_thread_data()->mail->busySince.store(std::chrono::steady_clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+			}
+
+			// Whether a thread is looking for work or started its current job less than return_same_wait ago.
+			bool is_responsive(std::size_t threadId) {
+				std::chrono::steady_clock::rep since = m_inboxes[threadId % m_threadCount]->busySince.load(std::memory_order_relaxed);
+				return !since || std::chrono::steady_clock::now().time_since_epoch().count() - since < m_returnSameWait;
+			}
+
+			// Puts a job in this thread's next slot, moving whatever was there out to the queue. Other threads are still woken,
+			// so the job isn't stranded if this thread stays busy.
+			void push_next(queue_item_t&& item) {
+				queue_item_t* displaced = current_thread_data()->next->exchange(job_node::make(std::forward<queue_item_t>(item)));
+				if (displaced) {
+					queue_item_t old;
+					job_node::take(displaced, old);
+					push_shared(std::move(old));
+				}
+				notify_workers();
+				main_event().notify();
+			}
+
+			// Moves count items out of a contiguous range into the queue.
+			template<std::size_t ToThread, std::uint8_t Priority = NOVA_DEFAULT_PRIORITY>
+			void push(queue_item_t* items, std::size_t count) {
+				if (!count)
+					return;
+				if constexpr(ToThread >= first_node_target && ToThread != any_thread) {
+					std::size_t domain = (ToThread - first_node_target) % m_domainCount;
+					domain_queue(domain).push(domain_data(domain), items, count);
+					notify_workers(count);
+					main_event().notify();
+				}
+				else if constexpr(ToThread != any_thread) {
+					std::size_t target = ToThread % m_threadCount;
+					m_inboxes[target]->push(items, count);
+					notify_inbox(target);
 				}
 				else {
-					m_globalQueue.push(current_thread_data()->globalData, std::forward<decltype(items)>(items));
-					WakeAllConditionVariable(&global_condition_variable());
-					WakeConditionVariable(&main_condition_variable());
+					work_stealing_deque* deque = current_thread_data()->deque.get();
+					if (deque && Priority == NOVA_DEFAULT_PRIORITY) {
+						for (std::size_t i = 0; i < count; i++)
+							deque->push(std::move(items[i]));
+					}
+					else if (Priority == NOVA_DEFAULT_PRIORITY) {
+						std::size_t domain = current_thread_data()->domain;
+						domain_queue(domain).push(domain_data(domain), items, count);
+					}
+					else {
+						m_globalQueues[Priority].push(current_thread_data()->globalData[Priority], items, count);
+					}
+					notify_workers(count);
+					main_event().notify();
 				}
 			}
 
+			template<std::size_t ToThread, std::uint8_t Priority = NOVA_DEFAULT_PRIORITY, typename Collection>
+			void push(Collection && items) {
+				push<ToThread, Priority>(items.data(), items.size());
+			}
+
 			thread_data make_thread_data() {
-				return { m_globalQueue.make_queue_data(), m_mainQueue.make_queue_data() };
+				std::vector<moodycamel_adaptor::queue_data> globalData;
+				globalData.reserve(NOVA_PRIORITY_LEVELS);
+				for (moodycamel_adaptor& queue : m_globalQueues)
+					globalData.push_back(queue.make_queue_data());
+				std::vector<moodycamel_adaptor::queue_data> domainData;
+				domainData.reserve(m_domainCount - 1);
+				for (std::size_t d = 1; d < m_domainCount; d++)
+					domainData.push_back(m_domainQueues[d - 1]->make_queue_data());
+				return { std::move(globalData), std::move(domainData), nullptr, 0, 0, std::make_unique<next_slot>(),
+					m_workStealing ? std::make_unique<work_stealing_deque>() : nullptr, m_maxSpin };
+			}
+
+			// Sets up the table of the next run's threads. With work stealing, each of them gets its own deque and the global
+			// queue is left to threads outside the pool. Threads are grouped into NUMA domains by the layout, and each domain
+			// gets its own default-level queue. Must be called before any thread data is made for the run.
+			void begin_run(std::size_t threadCount, bool workStealing, unsigned maxSpin, std::chrono::steady_clock::duration returnSameWait,
+				thread_layout layout) {
+				// Inboxes and domain queues outlive the run, like the global queues, so a later run still gets anything left in them.
+				while (m_inboxes.size() < threadCount)
+					m_inboxes.push_back(std::make_unique<inbox>());
+				while (m_domainQueues.size() + 1 < layout.domainCount)
+					m_domainQueues.push_back(std::make_unique<moodycamel_adaptor>());
+				m_domainCount = layout.domainCount;
+				m_layout = std::move(layout);
+				m_threads.reset(new std::atomic<thread_data*>[threadCount]);
+				for (std::size_t i = 0; i < threadCount; i++)
+					m_threads[i].store(nullptr, std::memory_order_relaxed);
+				m_threadCount = threadCount;
+				m_workStealing = workStealing;
+				m_maxSpin = maxSpin;
+				m_returnSameWait = returnSameWait.count();
+			}
+
+			// Called once the run's threads have all been joined.
+			void end_run() {
+				m_threads.reset();
+				m_threadCount = 0;
+				m_workStealing = false;
+				m_domainCount = 1;
+			}
+
+			// Hands a thread its inbox and makes its next slot and deque visible to the other threads.
+			void register_thread(std::size_t threadId, thread_data& td) {
+				td.mail = m_inboxes[threadId].get();
+				td.id = threadId;
+				td.domain = m_layout.domains[threadId];
+				if (threadId < m_threadCount)
+					m_threads[threadId].store(&td, std::memory_order_release);
 			}
 
 		private:
-			bool try_pop_main_queue(queue_item_t & item) {
-				bool exp = false;
-				if (is_main_queue_empty.compare_exchange_weak(exp, true, std::memory_order_relaxed)
-					&& m_mainQueue.pop(current_thread_data()->mainData, item)) {
-					is_main_queue_empty.store(false, std::memory_order_relaxed);
+			// Marks the thread idle while it looks for a job, and busy from when it finds one.
+			template<bool Main>
+			void pop(queue_item_t& item, event_count& event) {
+				std::atomic<std::chrono::steady_clock::rep>& busySince = current_thread_data()->mail->busySince;
+				busySince.store(0, std::memory_order_relaxed);
+				pop_idle<Main>(item, event);
+				mark_busy();
+			}
+
+			// Looks through every source of work with exponential backoff between looks, then sleeps until a push comes in.
+			// The thread's spin budget doubles each time spinning pays off and halves each time it has to park, so threads
+			// that keep finding nothing stop burning cycles. A bulk push only wakes as many threads as it has jobs, so a
+			// thread that wakes up to find work passes the wakeup on while there's more left.
+			template<bool Main>
+			void pop_idle(queue_item_t& item, event_count& event) {
+				unsigned& budget = current_thread_data()->spinBudget;
+				unsigned floor = (std::min)(m_maxSpin, static_cast<unsigned>(NOVA_MIN_SPIN_COUNT));
+				unsigned spun = 0;
+				unsigned backoff = 1;
+				bool woken = false;
+				std::chrono::steady_clock::duration trimAge = resources::fiber_trim_age();
+				std::chrono::steady_clock::time_point idleSince;
+				bool cacheTrimmed = trimAge.count() <= 0;
+				while (!try_pop<Main>(item, spun > NOVA_NEXT_STEAL_SPINS)) {
+					if (spun < budget) {
+						for (unsigned i = 0; i < backoff; i++)
+							cpu_relax();
+						spun += backoff;
+						backoff = (std::min)(backoff * 2, static_cast<unsigned>(NOVA_MAX_SPIN_BACKOFF));
+						continue;
+					}
+					// The fibers in this thread's cache have been idle at least as long as the thread has been parked.
+					std::chrono::steady_clock::duration untilTrim{ 0 };
+					if (!cacheTrimmed) {
+						std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+						if (!woken)
+							idleSince = now;
+						if (now - idleSince >= trimAge) {
+							resources::trim_fiber_cache();
+							cacheTrimmed = true;
+						}
+						else
+							untilTrim = trimAge - (now - idleSince);
+					}
+					std::uint32_t key = event.prepare_wait();
+					if constexpr(!Main) {
+						current_thread_data()->mail->parked.store(true, std::memory_order_release);
+						m_parkedWorkers.fetch_add(1, std::memory_order_seq_cst);
+						std::atomic_thread_fence(std::memory_order_seq_cst);
+					}
+					if (try_pop<Main>(item, true)) {
+						unpark<Main>();
+						event.cancel_wait();
+						return;
+					}
+					budget = (std::max)(budget / 2, floor);
+					// While a return_same resumption is queued, sleep no longer than it may have to wait for a busy thread.
+					// Sleep no longer than the thread's cache has left before it's trimmed, either.
+					if (m_pendingResumes.load(std::memory_order_seq_cst))
+						event.commit_wait_for(key, std::chrono::steady_clock::duration(m_returnSameWait));
+					else if (!cacheTrimmed)
+						event.commit_wait_for(key, untilTrim);
+					else
+						event.commit_wait(key);
+					unpark<Main>();
+					woken = true;
+					spun = 0;
+					backoff = 1;
+				}
+				if (woken) {
+					if (has_shared_work())
+						notify_workers();
+				}
+				else if (spun) {
+					budget = (std::min)((std::max)(budget * 2, floor), m_maxSpin);
+				}
+			}
+
+			// The thread's inbox and more urgent levels come first, then its own default-level work, then its domain's, then
+			// other domains'. After every NOVA_PRIORITY_AGING_INTERVAL jobs popped, every level but the most urgent gets the
+			// first look in turn, so none of them can starve.
+			template<bool Main>
+			bool try_pop(queue_item_t& item, bool stealNext) {
+				thread_data* td = current_thread_data();
+				if (td->pops >= NOVA_PRIORITY_AGING_INTERVAL && try_pop_aged(item))
+					return true;
+				bool found = td->mail->pop(item) || try_pop_resume(item) || try_pop_levels(item, 0, NOVA_DEFAULT_PRIORITY)
+					|| try_pop_default(item)
+					|| try_pop_levels(item, NOVA_DEFAULT_PRIORITY + 1, NOVA_PRIORITY_LEVELS)
+					|| (stealNext && try_steal_next(item));
+				if (found)
+					td->pops++;
+				return found;
+			}
+
+			// The thread's own return_same resumptions, then those of threads that have been busy for too long to take theirs.
+			bool try_pop_resume(queue_item_t& item) {
+				if (!m_pendingResumes.load(std::memory_order_relaxed))
+					return false;
+				thread_data* td = current_thread_data();
+				if (td->mail->pop_resume(item)) {
+					m_pendingResumes.fetch_sub(1, std::memory_order_relaxed);
 					return true;
 				}
+				for (std::size_t i = 1; i < m_threadCount; i++) {
+					std::size_t t = (td->id + i) % m_threadCount;
+					if (!is_responsive(t) && m_inboxes[t]->steal_resume(item)) {
+						m_pendingResumes.fetch_sub(1, std::memory_order_relaxed);
+						counters().resumedViaInbox.fetch_sub(1, std::memory_order_relaxed);
+						counters().resumedElsewhere.fetch_add(1, std::memory_order_relaxed);
+						return true;
+					}
+				}
+				return false;
+			}
+
+			// Looks at the levels below the most urgent one, starting one further along each time.
+			bool try_pop_aged(queue_item_t& item) {
+				thread_data* td = current_thread_data();
+				td->pops = 0;
+				for (std::uint8_t i = 1; i < NOVA_PRIORITY_LEVELS; i++) {
+					td->agedLevel = td->agedLevel % (NOVA_PRIORITY_LEVELS - 1) + 1;
+					bool found = td->agedLevel == NOVA_DEFAULT_PRIORITY
+						? try_pop_default(item)
+						: try_pop_levels(item, td->agedLevel, td->agedLevel + 1);
+					if (found)
+						return true;
+				}
+				return false;
+			}
+
+			// Default-level work, nearest first.
+			bool try_pop_default(queue_item_t& item) {
+				thread_data* td = current_thread_data();
+				return try_pop_next(item) || try_pop_local(item)
+					|| try_pop_domain(item, td->domain) || try_steal(item, true)
+					|| try_pop_remote_domains(item) || try_steal(item, false);
+			}
+
+			bool try_pop_levels(queue_item_t& item, std::uint8_t first, std::uint8_t end) {
+				for (std::uint8_t level = first; level < end; level++) {
+					if (m_globalQueues[level].pop(current_thread_data()->globalData[level], item))
+						return true;
+				}
+				return false;
+			}
+
+			bool try_pop_domain(queue_item_t& item, std::size_t domain) {
+				return domain_queue(domain).pop(domain_data(domain), item);
+			}
+
+			bool try_pop_remote_domains(queue_item_t& item) {
+				std::size_t local = current_thread_data()->domain;
+				for (std::size_t d = 1; d < m_domainCount; d++) {
+					if (try_pop_domain(item, (local + d) % m_domainCount))
+						return true;
+				}
+				return false;
+			}
+
+			moodycamel_adaptor& domain_queue(std::size_t domain) {
+				return domain ? *m_domainQueues[domain - 1] : m_globalQueues[NOVA_DEFAULT_PRIORITY];
+			}
+
+			moodycamel_adaptor::queue_data& domain_data(std::size_t domain) {
+				thread_data* td = current_thread_data();
+				return domain ? td->domainData[domain - 1] : td->globalData[NOVA_DEFAULT_PRIORITY];
+			}
+
+			// Whether another thread could find something in the global queues or a deque.
+			bool has_shared_work() {
+				for (moodycamel_adaptor& queue : m_globalQueues) {
+					if (queue.size_approx())
+						return true;
+				}
+				for (std::size_t d = 1; d < m_domainCount; d++) {
+					if (m_domainQueues[d - 1]->size_approx())
+						return true;
+				}
+				for (std::size_t i = 0; i < m_threadCount; i++) {
+					thread_data* td = m_threads[i].load(std::memory_order_acquire);
+					if (td && td->deque && td->deque->size_approx())
+						return true;
+				}
+				return false;
+			}
+
+			void push_shared(queue_item_t&& item) {
+				if (work_stealing_deque* deque = current_thread_data()->deque.get())
+					deque->push(std::forward<queue_item_t>(item));
+				else
+					domain_queue(current_thread_data()->domain).push(domain_data(current_thread_data()->domain), std::forward<queue_item_t>(item));
+			}
+
+			bool try_pop_next(queue_item_t & item) {
+				queue_item_t* node = current_thread_data()->next->take();
+				if (!node)
+					return false;
+				job_node::take(node, item);
+				return true;
+			}
+
+			bool try_pop_local(queue_item_t & item) {
+				work_stealing_deque* deque = current_thread_data()->deque.get();
+				if (!deque)
+					return false;
+				queue_item_t* node = deque->pop();
+				if (!node)
+					return false;
+				job_node::take(node, item);
+				return true;
+			}
+
+			// Tries every other deque in this thread's domain, or every one outside it, once. Threads sharing a closer cache
+			// with this one come first; within a tier the first victim is random.
+			bool try_steal(queue_item_t & item, bool local) {
+				thread_data* td = current_thread_data();
+				if (!td->deque || (!local && m_domainCount == 1))
+					return false;
+				for (const victim_tier& tier : m_layout.victims[td->id]) {
+					std::size_t start = random_victim(tier.threads.size());
+					for (std::size_t i = 0; i < tier.threads.size(); i++) {
+						thread_data* victim = m_threads[tier.threads[(start + i) % tier.threads.size()]].load(std::memory_order_acquire);
+						if (!victim || (victim->domain == td->domain) != local)
+							continue;
+						if (queue_item_t* node = victim->deque->steal()) {
+							job_node::take(node, item);
+							(tier.sharedCache ? counters().localSteals : counters().remoteSteals).fetch_add(1, std::memory_order_relaxed);
+							return true;
+						}
+					}
+				}
 				return false;
 			}
 
+			// Tries every other thread's next slot once, starting from a random victim.
+			bool try_steal_next(queue_item_t & item) {
+				if (!m_threadCount)
+					return false;
+				std::size_t start = random_victim(m_threadCount);
+				for (std::size_t i = 0; i < m_threadCount; i++) {
+					thread_data* victim = m_threads[(start + i) % m_threadCount].load(std::memory_order_acquire);
+					if (!victim || victim == current_thread_data())
+						continue;
+					if (queue_item_t* node = victim->next->take()) {
+						job_node::take(node, item);
+						return true;
+					}
+				}
+				return false;
+			}
+
+			std::size_t random_victim(std::size_t count) {
+				std::uint32_t& seed = steal_seed();
+				seed ^= seed << 13;
+				seed ^= seed >> 17;
+				seed ^= seed << 5;
+				return seed % count;
+			}
+
+			template<bool Main>
+			void unpark() {
+				if constexpr(!Main) {
+					current_thread_data()->mail->parked.store(false, std::memory_order_relaxed);
+					m_parkedWorkers.fetch_sub(1, std::memory_order_relaxed);
+				}
+			}
+
+			// Wakes the thread if it's parked and nobody else has claimed it yet. Must be called after the work is published.
+			bool wake_worker(inbox& mail) {
+				if (!mail.parked.load(std::memory_order_relaxed) || !mail.parked.exchange(false, std::memory_order_acq_rel))
+					return false;
+				mail.wake.notify();
+				return true;
+			}
+
+			// Wakes up to count parked threads other than the main thread, starting from a random one. Each is claimed by clearing
+			// its parked flag, so concurrent pushes wake different threads. Must be called after the work is published.
+			void notify_workers(std::size_t count = 1) {
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				if (!m_parkedWorkers.load(std::memory_order_relaxed) || m_threadCount < 2)
+					return;
+				std::size_t workers = m_threadCount - 1;
+				std::size_t start = random_victim(workers);
+				for (std::size_t i = 0; i < workers && count; i++) {
+					if (wake_worker(*m_inboxes[1 + (start + i) % workers]))
+						count--;
+				}
+			}
+
+			// The main thread sleeps on its own event and the others on their inbox's, so only the target is woken.
+			void notify_inbox(std::size_t target) {
+				if (!target) {
+					main_event().notify();
+					return;
+				}
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				wake_worker(*m_inboxes[target]);
+			}
+
 			queue_wrapper() = default;
-			std::atomic_bool is_main_queue_empty{ true };
-			moodycamel_adaptor m_globalQueue;
-			moodycamel_adaptor m_mainQueue;
+			moodycamel_adaptor m_globalQueues[NOVA_PRIORITY_LEVELS];
+			// One per thread of the largest pool started so far.
+			std::vector<std::unique_ptr<inbox>> m_inboxes;
+			// Default-level queues of the domains after the first, for the most domains a run has had so far.
+			std::vector<std::unique_ptr<moodycamel_adaptor>> m_domainQueues;
+			std::size_t m_domainCount = 1;
+			thread_layout m_layout;
+			std::unique_ptr<std::atomic<thread_data*>[]> m_threads;
+			std::size_t m_threadCount = 0;
+			bool m_workStealing = false;
+			unsigned m_maxSpin = NOVA_SPIN_COUNT;
+			std::chrono::steady_clock::rep m_returnSameWait = 0;
+			// return_same resumptions queued in inboxes and not yet taken.
+			std::atomic<std::size_t> m_pendingResumes{ 0 };
+			// Threads other than the main thread that are parking or parked, so pushes can skip looking for them.
+			std::atomic<std::size_t> m_parkedWorkers{ 0 };
 
 			// Meyers singletons
-			static CONDITION_VARIABLE & global_condition_variable() {
-				static condition_wrapper cw;
-				return cw;
+			static event_count & main_event() {
+				static event_count ec;
+				return ec;
 			}
-			static CONDITION_VARIABLE & main_condition_variable() {
-				static condition_wrapper cw;
-				return cw;
-			}
-			static CRITICAL_SECTION & dummy_critical_section() {
-				static thread_local critical_wrapper cs;
-				static thread_local critical_lock cl(cs);
-				return cs;
+			NOVA_NOINLINE static std::uint32_t & steal_seed() {
+				static thread_local std::uint32_t seed = static_cast<std::uint32_t>(std::hash<std::thread::id>()(std::this_thread::get_id())) | 1;
+				return seed;
 			}
 		};
 	}
 
 #pragma endregion
 
-#pragma region worker_thread
+#pragma region topology
+
+	// How start_options::placement pins threads to CPUs. Thread ids map to CPUs in the order below, wrapping around if
+	// there are more threads than CPUs. Only CPUs the process is allowed to run on when the system starts are used.
+	enum class thread_placement {
+		// Threads aren't pinned.
+		none,
+		// Fill each core's SMT siblings, then the next core, then the next package.
+		compact,
+		// One thread per package in turn, then per core, and only then a second SMT sibling of each core.
+		scatter,
+		// One thread per physical core, skipping SMT siblings.
+		physical_cores
+	};
 
 	namespace impl {
-		inline LPVOID get_fresh_fiber(LPFIBER_START_ROUTINE startFunc) {
-			LPVOID newFiber;
+		struct cache_info {
+			unsigned level;
+			std::vector<unsigned> sharedCpus;
+		};
+
+		// A logical CPU, as described by /sys/devices/system/cpu.
+		struct cpu_info {
+			unsigned cpu;
+			unsigned core;
+			unsigned package;
+			// Position among the SMT siblings of its core, 0 for the first.
+			unsigned smt;
+			// Position among the cores of its package.
+			unsigned coreIndex;
+			unsigned node;
+			// Position of its NUMA node among the nodes with usable CPUs, which is the scheduling domain of threads pinned to it.
+			unsigned domain;
+			std::vector<cache_info> caches;
+		};
 
-			if (resources::available_fibers().size() > 0) {
-				newFiber = resources::available_fibers()[resources::available_fibers().size() - 1];
-				resources::available_fibers().pop_back();
+		class cpu_topology {
+		public:
+			// The CPUs the process could run on when this was first called, in ascending order. Empty if the topology can't
+			// be read, or off Linux.
+			static const std::vector<cpu_info>& cpus() {
+				static std::vector<cpu_info> cpus = read_cpus();
+				return cpus;
 			}
-			else
-				newFiber = CreateFiberEx(0, 0, FIBER_FLAG_FLOAT_SWITCH, startFunc, nullptr);
 
-			return newFiber;
-		}
+			// The CPU for each thread id, or nothing if threads aren't pinned.
+			static std::vector<unsigned> placement_order(thread_placement placement) {
+				std::vector<unsigned> result;
+				if (placement == thread_placement::none)
+					return result;
+				std::vector<cpu_info> order = cpus();
+				auto key = [placement](const cpu_info& c) {
+					if (placement == thread_placement::scatter)
+						return std::make_tuple(c.smt, c.coreIndex, c.package);
+					return std::make_tuple(c.package, c.coreIndex, c.smt);
+				};
+				std::stable_sort(order.begin(), order.end(), [&](const cpu_info& a, const cpu_info& b) { return key(a) < key(b); });
+				for (const cpu_info& c : order) {
+					if (placement != thread_placement::physical_cores || c.smt == 0)
+						result.push_back(c.cpu);
+				}
+				return result;
+			}
+
+			// Number of NUMA nodes with usable CPUs, or 1 if there's no NUMA information.
+			static std::size_t domain_count() {
+				std::size_t count = 1;
+				for (const cpu_info& c : cpus())
+					count = (std::max)(count, static_cast<std::size_t>(c.domain) + 1);
+				return count;
+			}
+
+			// Lays out threadCount thread ids given the CPUs they're pinned to. Threads that aren't pinned can run anywhere,
+			// so they all count as part of the first domain and as sharing no cache with anyone.
+			static queue_wrapper::thread_layout layout(const std::vector<unsigned>& placement, std::size_t threadCount) {
+				queue_wrapper::thread_layout layout;
+				layout.domainCount = domain_count();
+				layout.domains.assign(threadCount, 0);
+				std::vector<const cpu_info*> threadCpus(threadCount, nullptr);
+				for (std::size_t i = 0; i < threadCount && !placement.empty(); i++) {
+					for (const cpu_info& c : cpus()) {
+						if (c.cpu == placement[i % placement.size()])
+							threadCpus[i] = &c;
+					}
+					if (threadCpus[i])
+						layout.domains[i] = threadCpus[i]->domain;
+				}
+				layout.victims.resize(threadCount);
+				for (std::size_t i = 0; i < threadCount; i++) {
+					std::vector<std::pair<unsigned, std::size_t>> ranked;
+					for (std::size_t j = 0; j < threadCount; j++) {
+						if (j != i)
+							ranked.push_back({ closest_shared_cache(threadCpus[i], threadCpus[j]), j });
+					}
+					std::stable_sort(ranked.begin(), ranked.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+					for (std::size_t r = 0; r < ranked.size(); r++) {
+						if (!r || ranked[r].first != ranked[r - 1].first)
+							layout.victims[i].push_back({ {}, ranked[r].first != no_shared_cache });
+						layout.victims[i].back().threads.push_back(ranked[r].second);
+					}
+				}
+				return layout;
+			}
+
+			// Returns false if the thread couldn't be pinned, e.g. because the CPU was taken away from the process.
+			static bool pin_current_thread(unsigned cpu) {
+#if defined(__linux__)
+				cpu_set_t set;
+				CPU_ZERO(&set);
+				CPU_SET(cpu, &set);
+				return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+				(void)cpu;
+				return false;
+#endif
+			}
+
+		private:
+			static constexpr unsigned no_shared_cache = UINT_MAX;
+
+			// Level of the smallest cache two CPUs share, 0 if they're the same CPU.
+			static unsigned closest_shared_cache(const cpu_info* a, const cpu_info* b) {
+				if (!a || !b)
+					return no_shared_cache;
+				if (a->cpu == b->cpu)
+					return 0;
+				unsigned closest = no_shared_cache;
+				for (const cache_info& cache : a->caches) {
+					if (std::find(cache.sharedCpus.begin(), cache.sharedCpus.end(), b->cpu) != cache.sharedCpus.end())
+						closest = (std::min)(closest, cache.level);
+				}
+				return closest;
+			}
+
+			static std::vector<cpu_info> read_cpus() {
+				std::vector<cpu_info> cpus;
+#if defined(__linux__)
+				cpu_set_t allowed;
+				if (sched_getaffinity(0, sizeof(allowed), &allowed))
+					return cpus;
+				for (unsigned cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+					if (!CPU_ISSET(cpu, &allowed))
+						continue;
+					cpu_info info{ cpu, 0, 0, 0, 0, 0, 0, {} };
+					if (!read_topology_value(cpu, "core_id", info.core) || !read_topology_value(cpu, "physical_package_id", info.package))
+						return {};
+					for (unsigned index = 0;; index++) {
+						char path[128];
+						std::snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/cache/index%u/level", cpu, index);
+						cache_info cache;
+						if (!read_value(path, cache.level))
+							break;
+						std::snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/cache/index%u/shared_cpu_list", cpu, index);
+						cache.sharedCpus = read_cpu_list(path);
+						info.caches.push_back(std::move(cache));
+					}
+					cpus.push_back(info);
+				}
+				for (cpu_info& c : cpus) {
+					std::vector<unsigned> packageCores;
+					for (const cpu_info& other : cpus) {
+						if (other.package != c.package)
+							continue;
+						if (other.core == c.core && other.cpu < c.cpu)
+							c.smt++;
+						if (other.core < c.core && std::find(packageCores.begin(), packageCores.end(), other.core) == packageCores.end())
+							packageCores.push_back(other.core);
+					}
+					c.coreIndex = static_cast<unsigned>(packageCores.size());
+				}
+				read_nodes(cpus);
+#endif
+				return cpus;
+			}
+
+#if defined(__linux__)
+			// Without /sys/devices/system/node every CPU stays on node 0.
+			static void read_nodes(std::vector<cpu_info>& cpus) {
+				DIR* dir = opendir("/sys/devices/system/node");
+				if (!dir)
+					return;
+				while (dirent* entry = readdir(dir)) {
+					unsigned node;
+					char tail;
+					if (std::sscanf(entry->d_name, "node%u%c", &node, &tail) != 1)
+						continue;
+					char path[128];
+					std::snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", node);
+					for (unsigned cpu : read_cpu_list(path)) {
+						for (cpu_info& c : cpus) {
+							if (c.cpu == cpu)
+								c.node = node;
+						}
+					}
+				}
+				closedir(dir);
+				for (cpu_info& c : cpus) {
+					std::vector<unsigned> lowerNodes;
+					for (const cpu_info& other : cpus) {
+						if (other.node < c.node && std::find(lowerNodes.begin(), lowerNodes.end(), other.node) == lowerNodes.end())
+							lowerNodes.push_back(other.node);
+					}
+					c.domain = static_cast<unsigned>(lowerNodes.size());
+				}
+			}
+#endif
+
+			// Parses a sysfs CPU list like "0-3,8-11".
+			static std::vector<unsigned> read_cpu_list(const char* path) {
+				std::vector<unsigned> cpus;
+				std::FILE* file = std::fopen(path, "r");
+				if (!file)
+					return cpus;
+				unsigned first, last;
+				while (std::fscanf(file, "%u", &first) == 1) {
+					last = first;
+					int separator = std::fgetc(file);
+					if (separator == '-') {
+						if (std::fscanf(file, "%u", &last) != 1)
+							break;
+						separator = std::fgetc(file);
+					}
+					for (unsigned cpu = first; cpu <= last; cpu++)
+						cpus.push_back(cpu);
+					if (separator != ',')
+						break;
+				}
+				std::fclose(file);
+				return cpus;
+			}
+
+			static bool read_topology_value(unsigned cpu, const char* name, unsigned& value) {
+				char path[128];
+				std::snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/topology/%s", cpu, name);
+				return read_value(path, value);
+			}
+
+			static bool read_value(const char* path, unsigned& value) {
+				std::FILE* file = std::fopen(path, "r");
+				if (!file)
+					return false;
+				int read = std::fscanf(file, "%u", &value);
+				std::fclose(file);
+				return read == 1;
+			}
+		};
+
+		// Pins the main thread for the length of a run and gives it back its old affinity afterwards.
+		class main_thread_affinity {
+		public:
+			explicit main_thread_affinity(const std::vector<unsigned>& placement) {
+#if defined(__linux__)
+				if (placement.empty())
+					return;
+				if (!sched_getaffinity(0, sizeof(m_saved), &m_saved))
+					m_pinned = cpu_topology::pin_current_thread(placement[0]);
+				if (!m_pinned)
+					queue_wrapper::counters().unpinnedThreads.fetch_add(1, std::memory_order_relaxed);
+#else
+				(void)placement;
+#endif
+			}
+
+			main_thread_affinity(const main_thread_affinity&) = delete;
+			main_thread_affinity& operator=(const main_thread_affinity&) = delete;
+
+			~main_thread_affinity() {
+#if defined(__linux__)
+				if (m_pinned)
+					sched_setaffinity(0, sizeof(m_saved), &m_saved);
+#endif
+			}
+		private:
+#if defined(__linux__)
+			cpu_set_t m_saved;
+#endif
+			bool m_pinned = false;
+		};
+	}
+
+#pragma endregion
+
+#pragma region worker_thread
+
+	namespace impl {
+		inline fiber* get_fresh_fiber(std::uint8_t stackClass);
+		inline void finish_called_job(fiber* oldFiber);
 
 		class worker_thread {
 		public:
@@ -624,7 +2900,20 @@ namespace nova {
 			static std::size_t get_thread_count() {
 				return thread_count();
 			}
+			// Sets the size of the pool for a new run. Thread ids are handed out from 1 (the main thread is 0) each time the
+			// system starts, but the count covers threads that haven't started yet, so none of them miss a kill job.
+			static void set_thread_count(std::size_t count) {
+				thread_count() = count;
+				next_thread_id() = 1;
+			}
+			// The CPU each thread id is pinned to in the current run, or empty if threads aren't pinned.
+			static std::vector<unsigned> & placement() {
+				static std::vector<unsigned> cpus;
+				return cpus;
+			}
 			static void job_loop() {
+				// A job loop never leaves the fiber it started on, even if that fiber changes threads.
+				std::uint8_t stackClass = fiber::current()->stack_class();
 				while (worker_thread::is_running()) {
 					job j;
 					if (worker_thread::get_thread_id() == 0)
@@ -632,14 +2921,62 @@ namespace nova {
 					else
 						queue_wrapper::instance().pop(j);
 
-					raii_ptr<dependency_token> rp(resources::dependent_token(), &j.get_dependency_token());
-					j();
+					if (stackClass != thread_stack_class) {
+						std::uint8_t jobClass = resources::resolve_stack_class(j.stack_class());
+						if (jobClass != stackClass && jobClass != any_stack_class) {
+							hand_off(j, jobClass);
+							continue;
+						}
+					}
+
+					run_job(j);
+					release_job(j);
+				}
+			}
+
+			// The dependent token belongs to whatever is running on the fiber rather than to the thread, so it's saved and
+			// restored around anything that can suspend. The fiber may come back on another thread.
+			static void run_job(job & j) {
+				dependency_token * outer = resources::dependent_token();
+				resources::dependent_token() = &j.get_dependency_token();
+				j();
+				resources::dependent_token() = outer;
+			}
+
+			// Destroys a job that has run. If that completes a call, this fiber has nothing left to do, so it goes back to
+			// the pool and the worker switches straight to the caller instead of queueing its resumption. The caller counts as
+			// a new job, so return_same resumptions queued behind it aren't taken by other threads early.
+			static void release_job(job & j) {
+				fiber* resumed = nullptr;
+				resources::resume_slot() = &resumed;
+				j = job();
+				resources::resume_slot() = nullptr;
+				if (resumed) {
+					queue_wrapper::instance().mark_busy();
+					finish_called_job(resumed);
 				}
 			}
 
-			static void enter_job_loop(LPVOID jobPtr) {
+			// Entry point of every pooled fiber.
+			static void fiber_main() {
+				resume_fiber();
 				job_loop();
-				SwitchToFiber(resources::initial_fiber());
+				resources::release_fiber(fiber::current());
+				resources::initial_fiber()->switch_to();
+			}
+
+			// Must be called whenever a pooled fiber starts or resumes; finishes whatever the fiber that switched to it left
+			// pending, either releasing the token of the call it suspended or running the job it handed off.
+			static void resume_fiber() {
+				if (dependency_token * ct = resources::call_token()) {
+					resources::call_token() = nullptr;
+					ct->Release();
+				}
+				if (job * hj = resources::handoff_job()) {
+					resources::handoff_job() = nullptr;
+					job j(std::move(*hj));
+					run_job(j);
+				}
 			}
 			static void kill_worker() {
 				running() = false;
@@ -652,27 +2989,41 @@ namespace nova {
 				m_thread.join();
 			}
 		private:
+			// Moves a job to a fiber of the size class it needs and parks the current fiber in its pool.
+			static void hand_off(job & j, std::uint8_t stackClass) {
+				fiber* self = fiber::current();
+				fiber* target = get_fresh_fiber(stackClass);
+				resources::release_fiber(self);
+				resources::handoff_job() = &j;
+				target->switch_to();
+				resume_fiber();
+			}
+
 			void init_thread() {
 				{
 					critical_lock cl(init_lock());
-					thread_id() = thread_count();
-					thread_count()++;
+					thread_id() = next_thread_id()++;
 				}
+				//Pinned before anything is allocated, so the thread's fibers are first touched on its own CPU
+				if (!placement().empty() && !cpu_topology::pin_current_thread(placement()[thread_id() % placement().size()]))
+					queue_wrapper::counters().unpinnedThreads.fetch_add(1, std::memory_order_relaxed);
 				queue_wrapper::current_thread_data() = &m_thread_data;
-				ConvertThreadToFiberEx(NULL, FIBER_FLAG_FLOAT_SWITCH);
-				resources::initial_fiber() = GetCurrentFiber();
+				queue_wrapper::instance().register_thread(thread_id(), m_thread_data);
+				resources::initial_fiber() = fiber::convert_thread();
+				resources::prewarm_fiber_pool();
 
-				SwitchToFiber(get_fresh_fiber(enter_job_loop));
+				get_fresh_fiber(resources::default_stack_class())->switch_to();
 
 				resources::delete_fiber_pool();
+				fiber::revert_thread();
 			}
 
 			// Meyers singletons
-			static std::size_t & thread_id() {
+			NOVA_NOINLINE static std::size_t & thread_id() {
 				static thread_local std::size_t id = 0;
 				return id;
 			}
-			static bool & running() {
+			NOVA_NOINLINE static bool & running() {
 				static thread_local bool running = true;
 				return running;
 			}
@@ -680,6 +3031,10 @@ namespace nova {
 				static std::size_t count = 1;
 				return count;
 			}
+			static std::size_t & next_thread_id() {
+				static std::size_t id = 1;
+				return id;
+			}
 			static critical_wrapper & init_lock() {
 				static critical_wrapper lock;
 				return lock;
@@ -688,6 +3043,20 @@ namespace nova {
 			queue_wrapper::thread_data m_thread_data;
 			std::thread m_thread;
 		};
+
+		inline fiber* get_fresh_fiber(std::uint8_t stackClass) {
+			fiber* newFiber = resources::acquire_fiber(stackClass);
+
+			if (!newFiber)
+				newFiber = resources::create_fiber(stackClass);
+
+			return newFiber;
+		}
+
+		inline fiber* resources::create_fiber(std::uint8_t stackClass) {
+			fiber_depot::counters().created.fetch_add(1, std::memory_order_relaxed);
+			return fiber::create(worker_thread::fiber_main, stackClass);
+		}
 	}
 
 #pragma endregion
@@ -804,14 +3173,17 @@ namespace nova {
 	namespace impl {
 
 		//Converts a BatchJob into a vector of Envelopes
-		template<typename Callable, typename ... Params>
+		template<std::uint8_t StackClass, typename Callable, typename ... Params>
 		static std::vector<job> split_batch_function(batch_function<Callable, Params...> && bf) {
 			std::vector<job> jobs;
 			jobs.reserve(bf.get_sections());
 			typedef batch_function<Callable, Params...> ptrType;
-			std::shared_ptr<ptrType> basePtr = std::make_shared<ptrType>(bf);
-			for (unsigned int section = 0; section < bf.get_sections(); section++) {
-				jobs.emplace_back(basePtr);
+			std::shared_ptr<ptrType> basePtr = std::make_shared<ptrType>(std::move(bf));
+			for (unsigned int section = 0; section < basePtr->get_sections(); section++) {
+				if constexpr(StackClass == default_stack_class)
+					jobs.emplace_back(basePtr);
+				else
+					jobs.emplace_back(stack_class_runnable<std::shared_ptr<ptrType>, StackClass>{ basePtr });
 			}
 			return jobs;
 		}
@@ -835,20 +3207,23 @@ namespace nova {
 
 	namespace impl {
 
-		//Loads a Runnable into an envelope and pushes it to the given vector. Allocates.
-		template<bool Alloc, typename Runnable, std::size_t N>
+		//Loads a Runnable into an envelope and pushes it to the given vector. Allocates. Jobs that own their Runnable take their
+		//stack size class from it, so a StackClass other than the default wraps it; the others are given theirs by the caller.
+		template<bool Alloc, std::uint8_t StackClass, typename Runnable, std::size_t N>
 		static void pack_runnable(std::array<job, N> & jobs, std::size_t & index, std::vector<job> & batchJobs, Runnable&& runnable) {
-			if constexpr(Alloc)
+			if constexpr(Alloc && StackClass != default_stack_class)
+				jobs[index++] = std::move(job{ stack_class_runnable<std::decay_t<Runnable>, StackClass>{ std::forward<Runnable>(runnable) } });
+			else if constexpr(Alloc)
 				jobs[index++] = std::move(job{ std::forward<Runnable>(runnable) });
 			else
 				jobs[index++] = { &runnable };
 		}
 
 		//Special overload for batch jobs - splits into envelopes and inserts them into the given vector Allocates.
-		template<bool Alloc, typename Callable, typename ... Params, std::size_t N>
+		template<bool Alloc, std::uint8_t StackClass, typename Callable, typename ... Params, std::size_t N>
 		static void pack_runnable(std::array<job, N> & jobs, std::size_t & index, std::vector<job> & batchJobs, batch_function<Callable, Params...> && bf) {
 			if constexpr(Alloc) {
-				std::vector<job> splitEnvs = split_batch_function(std::forward<decltype(bf)>(bf));
+				std::vector<job> splitEnvs = split_batch_function<StackClass>(std::forward<decltype(bf)>(bf));
 				batchJobs.insert(batchJobs.end(), std::make_move_iterator(splitEnvs.begin()), std::make_move_iterator(splitEnvs.end()));
 			}
 			else {
@@ -858,17 +3233,17 @@ namespace nova {
 		}
 
 		//Breaks a Runnable off the parameter pack and recurses
-		template<bool Alloc, std::size_t N, typename Runnable, typename ... Runnables>
+		template<bool Alloc, std::uint8_t StackClass, std::size_t N, typename Runnable, typename ... Runnables>
 		static void pack_runnable(std::array<job, N> & jobs, std::size_t & index, std::vector<job> & batchJobs, Runnable && runnable, Runnables&&... runnables) {
-			pack_runnable<Alloc>(jobs, index, batchJobs, std::forward<Runnable>(runnable));
-			pack_runnable<Alloc>(jobs, index, batchJobs, std::forward<Runnables>(runnables)...);
+			pack_runnable<Alloc, StackClass>(jobs, index, batchJobs, std::forward<Runnable>(runnable));
+			pack_runnable<Alloc, StackClass>(jobs, index, batchJobs, std::forward<Runnables>(runnables)...);
 		}
 
 		//Generates Envelopes from the given Runnables and inserts them into a std::array (for standalone) or a std::vector (for batch)
-		template<bool Alloc, std::size_t N, typename ... Runnables>
+		template<bool Alloc, std::uint8_t StackClass = default_stack_class, std::size_t N, typename ... Runnables>
 		static void pack_runnable(std::array<job, N> & jobs, std::vector<job> & batchJobs, Runnables&&... runnables) {
 			std::size_t index(0);
-			pack_runnable<Alloc>(jobs, index, batchJobs, std::forward<Runnables>(runnables)...);
+			pack_runnable<Alloc, StackClass>(jobs, index, batchJobs, std::forward<Runnables>(runnables)...);
 		}
 
 	}
@@ -897,57 +3272,81 @@ namespace nova {
 		struct batch_count<First, Args...> {
 			static const int value = batch_count<Args...>::value;
 		};
+
+#if defined(NOVA_REPORT_SPILLS)
+		// Called for every Runnable that fits in its job on its own but not beside a dependency_token, when it's pushed with one.
+		template<typename Runnable, std::size_t Size>
+		[[deprecated("Runnable doesn't fit beside a dependency_token in NOVA_JOB_BYTES and is allocated when pushed with dependent")]]
+		inline void report_token_spill() {}
+
+		// Their jobs get the token after they're made, so the spill can't be reported where the job is.
+		template<typename ... Runnables>
+		void report_token_spills() {
+			([] {
+				using T = std::decay_t<Runnables>;
+				if constexpr(batch_count<T>::value == 0 && job::fits_inline<T> && !job::fits_with_token<T>)
+					report_token_spill<T, sizeof(T)>();
+			}(), ...);
+		}
+#endif
 	}
 
 #pragma endregion
 
 	namespace impl{
 
-		//Queues an array of Envelopes
-		template<bool ToMain, std::size_t N>
+		//Queues an array of Envelopes. A lone job of the default priority goes to the pushing thread's next slot.
+		template<std::size_t ToThread, std::uint8_t Priority, std::size_t N>
 		void push(std::array<impl::job, N> && jobs) {
-			queue_wrapper::instance().push<ToMain>(std::forward<decltype(jobs)>(jobs));
+			if constexpr(ToThread == any_thread && N == 1 && Priority == NOVA_DEFAULT_PRIORITY)
+				queue_wrapper::instance().push_next(std::move(jobs[0]));
+			else
+				queue_wrapper::instance().push<ToThread, Priority>(std::forward<decltype(jobs)>(jobs));
 		}
 
-		template<bool ToMain, std::size_t N>
+		template<std::size_t ToThread, std::uint8_t Priority, std::size_t N>
 		void push(dependency_token & dt, std::array<job, N> && jobs) {
 			for (job & j : jobs)
 				j.set_dependency_token(dt);
-			push<ToMain>(std::forward<decltype(jobs)>(jobs));
+			push<ToThread, Priority>(std::forward<decltype(jobs)>(jobs));
 		}
 
 		//Queues a vector of envelopes
-		template<bool ToMain>
+		template<std::size_t ToThread, std::uint8_t Priority>
 		void push(std::vector<impl::job> && jobs) {
-			queue_wrapper::instance().push<ToMain>(std::forward<decltype(jobs)>(jobs));
+			queue_wrapper::instance().push<ToThread, Priority>(std::forward<decltype(jobs)>(jobs));
 		}
 
 		//Queues a vector of envelopes
-		template<bool ToMain>
+		template<std::size_t ToThread, std::uint8_t Priority>
 		void push(dependency_token & dt, std::vector<job> && jobs) {
 			for (job & j : jobs)
 				j.set_dependency_token(dt);
-			push<ToMain>(std::forward<decltype(jobs)>(jobs));
+			push<ToThread, Priority>(std::forward<decltype(jobs)>(jobs));
 		}
 
-		template<bool ToMain, bool Dependent, typename Collection>
+		template<std::size_t ToThread, bool Dependent, std::uint8_t Priority, typename Collection>
 		void push_picker(Collection && collection) {
 			if constexpr(Dependent)
-				impl::push<ToMain>(*resources::dependent_token(), std::forward<Collection>(collection));
+				impl::push<ToThread, Priority>(*resources::dependent_token(), std::forward<Collection>(collection));
 			else
-				impl::push<ToMain>(std::forward<Collection>(collection));
+				impl::push<ToThread, Priority>(std::forward<Collection>(collection));
 		}
 
 		//Queues a set of Runnables
-		template<bool ToMain, bool Dependent, typename ... Runnables >
+		template<std::size_t ToThread, bool Dependent, std::uint8_t Priority, typename ... Runnables >
 		void push(Runnables&&... runnables) {
 			using namespace impl;
 			std::array<job, sizeof...(Runnables)-batch_count<Runnables...>::value> jobs;
 			std::vector<job> batchJobs;
 			batchJobs.reserve(batch_count<Runnables...>::value * 4);
+#if defined(NOVA_REPORT_SPILLS)
+			if constexpr(Dependent)
+				report_token_spills<Runnables...>();
+#endif
 			pack_runnable<true>(jobs, batchJobs, std::forward<Runnables>(runnables)...);
-			push_picker<ToMain, Dependent>(std::move(jobs));
-			push_picker<ToMain, Dependent>(std::move(batchJobs));
+			push_picker<ToThread, Dependent, Priority>(std::move(jobs));
+			push_picker<ToThread, Dependent, Priority>(std::move(batchJobs));
 		}
 	}
 
@@ -959,8 +3358,29 @@ namespace nova {
 	struct to_main {};
 	// Control that causes a synchronous invocation to return to the main thread
 	struct return_main {};
+	// Control that causes Runnables to be invoked on the thread with the given id. Ids past the end of the pool wrap around.
+	template<std::size_t ThreadId>
+	struct to_thread {};
+	// Control that causes a synchronous invocation to return to the thread with the given id. Ids past the end of the pool wrap around.
+	template<std::size_t ThreadId>
+	struct return_to_thread {};
+	// Control that causes Runnables to be queued for the threads pinned to the given NUMA node, which take them before other nodes'
+	// work. Nodes are counted from 0 among those with CPUs the process can use, which on most machines matches the system's
+	// numbering. Nodes past the last one wrap around.
+	template<std::size_t Node>
+	struct numa_node {};
+	// Control that causes a synchronous invocation to return to the thread it was called from, unless that thread has been busy
+	// with another job for longer than start_options::return_same_wait
+	struct return_same {};
 	// Control that prevents a currently active synchronous invocation from returning until the invokees of the asynchronous invocation affected by the Control return
 	struct dependent {};
+	// Control that causes a synchronous invocation's Runnables to be invoked on fibers with stacks of at least Bytes bytes, rounded up to a power of two
+	template<std::size_t Bytes>
+	struct stack_size {};
+	// Control that puts Runnables at the given priority level, from 0 (most urgent) to NOVA_PRIORITY_LEVELS - 1. Runnables without
+	// one are at NOVA_DEFAULT_PRIORITY. Doesn't affect Runnables invoked on a particular thread.
+	template<std::uint8_t Level>
+	struct priority {};
 
 	template<typename T, typename ... Ts>
 	struct includes_type;
@@ -980,61 +3400,282 @@ namespace nova {
 		static const bool value = false || includes_type<T, Ts...>::value;
 	};
 
+	namespace impl {
+		template<typename ... Ts>
+		struct stack_class_of {
+			static const std::uint8_t value = default_stack_class;
+		};
+
+		template<std::size_t Bytes, typename ... Ts>
+		struct stack_class_of<stack_size<Bytes>, Ts...> {
+			static const std::uint8_t value = stack_class_for(Bytes);
+		};
+
+		template<typename T, typename ... Ts>
+		struct stack_class_of<T, Ts...> {
+			static const std::uint8_t value = stack_class_of<Ts...>::value;
+		};
+
+		template<typename ... Ts>
+		struct priority_of {
+			static const std::uint8_t value = NOVA_DEFAULT_PRIORITY;
+		};
+
+		static_assert(NOVA_DEFAULT_PRIORITY < NOVA_PRIORITY_LEVELS, "NOVA_DEFAULT_PRIORITY must be below NOVA_PRIORITY_LEVELS");
+
+		template<std::uint8_t Level, typename ... Ts>
+		struct priority_of<priority<Level>, Ts...> {
+			static_assert(Level < NOVA_PRIORITY_LEVELS, "priority level out of range");
+			static const std::uint8_t value = Level;
+		};
+
+		template<typename T, typename ... Ts>
+		struct priority_of<T, Ts...> {
+			static const std::uint8_t value = priority_of<Ts...>::value;
+		};
+
+		// The thread that to_main or to_thread sends Runnables to, or any_thread.
+		template<typename ... Ts>
+		struct target_thread_of {
+			static const std::size_t value = any_thread;
+		};
+
+		template<typename ... Ts>
+		struct target_thread_of<to_main, Ts...> {
+			static const std::size_t value = 0;
+		};
+
+		template<std::size_t ThreadId, typename ... Ts>
+		struct target_thread_of<to_thread<ThreadId>, Ts...> {
+			static const std::size_t value = ThreadId;
+		};
+
+		template<std::size_t Node, typename ... Ts>
+		struct target_thread_of<numa_node<Node>, Ts...> {
+			static const std::size_t value = first_node_target + Node;
+		};
+
+		template<typename T, typename ... Ts>
+		struct target_thread_of<T, Ts...> {
+			static const std::size_t value = target_thread_of<Ts...>::value;
+		};
+
+		// The thread that return_main or return_to_thread sends a caller back to, or any_thread.
+		template<typename ... Ts>
+		struct return_thread_of {
+			static const std::size_t value = any_thread;
+		};
+
+		template<typename ... Ts>
+		struct return_thread_of<return_main, Ts...> {
+			static const std::size_t value = 0;
+		};
+
+		template<std::size_t ThreadId, typename ... Ts>
+		struct return_thread_of<return_to_thread<ThreadId>, Ts...> {
+			static const std::size_t value = ThreadId;
+		};
+
+		template<typename ... Ts>
+		struct return_thread_of<return_same, Ts...> {
+			static const std::size_t value = same_thread;
+		};
+
+		template<typename T, typename ... Ts>
+		struct return_thread_of<T, Ts...> {
+			static const std::size_t value = return_thread_of<Ts...>::value;
+		};
+
+		// Whether the current thread is the one a thread control picked. Ids wrap around like they do for pushes. Owner is
+		// the thread a return_same call was made on.
+		template<std::size_t ThreadId>
+		bool on_thread(std::size_t owner = any_thread) {
+			if constexpr(ThreadId == same_thread)
+				return worker_thread::get_thread_id() == owner;
+			else if constexpr(ThreadId >= first_node_target && ThreadId != any_thread)
+				return queue_wrapper::instance().is_in_domain(ThreadId - first_node_target);
+			else
+				return ThreadId == any_thread || worker_thread::get_thread_id() == ThreadId % worker_thread::get_thread_count();
+		}
+	}
+
 #pragma endregion
 
 	// Asynchronously invokes a set of Runnable objects.
 	// Accepts the following Controls:
 	// to_main - the Runnables will be invoked on the main thread
+	// to_thread<ThreadId> - the Runnables will be invoked on the thread with the given id
+	// numa_node<Node> - the Runnables will be queued for the threads on the given NUMA node
 	// dependent - if the current job was invoked synchronously, it will not return until the Runnables all return
+	// priority<Level> - the Runnables will be queued at the given priority level
 	template<typename ... Controls, typename ... Runnables>
 	void push(Runnables&&... runnables) {
-		impl::push<includes_type<to_main, Controls...>::value, includes_type<dependent, Controls...>::value>(std::forward<Runnables>(runnables)...);
+		impl::push<impl::target_thread_of<Controls...>::value, includes_type<dependent, Controls...>::value, impl::priority_of<Controls...>::value>(std::forward<Runnables>(runnables)...);
 	}
 
 #pragma region call
 
 	namespace impl{
 
-		template<bool ToMain, std::size_t N>
+		template<std::size_t ToThread, std::uint8_t Priority, std::size_t N>
 		void call_push(dependency_token & dt, std::array<job, N> && jobs, std::vector<job> && batchJobs) {
-			push<ToMain>(dt, std::forward<decltype(jobs)>(jobs));
-			push<ToMain>(dt, std::forward<decltype(batchJobs)>(batchJobs));
+			push<ToThread, Priority>(dt, std::forward<decltype(jobs)>(jobs));
+			push<ToThread, Priority>(dt, std::forward<decltype(batchJobs)>(batchJobs));
 		}
 
-		template<bool ToMain>
-		void call_push(dependency_token & dt) {}
+		template<std::size_t ToThread, std::uint8_t Priority>
+		void call_push(dependency_token & dt, job* jobs, std::size_t count) {
+			for (std::size_t i = 0; i < count; i++)
+				jobs[i].set_dependency_token(dt);
+			queue_wrapper::instance().push<ToThread, Priority>(jobs, count);
+		}
 
-		inline void finish_called_job(LPVOID oldFiber) {
+		inline void finish_called_job(fiber* oldFiber) {
 			//Mark for re-use
-			resources::available_fibers().push_back(GetCurrentFiber());
-			SwitchToFiber(oldFiber);
+			resources::release_fiber(fiber::current());
+			oldFiber->switch_to();
 
 			//Re-use starts here
-			resources::call_token()->Release();
+			worker_thread::resume_fiber();
+		}
+
+		//Resumes a suspended call. It barely touches the stack, so it can run on whatever fiber pops it.
+		struct finish_called_job_runnable {
+			fiber* oldFiber;
+
+			void operator()() {
+				finish_called_job(oldFiber);
+			}
+		};
+
+		template<>
+		struct runnable_stack_class<finish_called_job_runnable> {
+			static const std::uint8_t value = any_stack_class;
+		};
+
+		// Queues the resumption of a return_same caller in the inbox of the thread it was called from. If that thread has been
+		// stuck in one job for too long, now or while the resumption waits, any thread can take it instead.
+		template<std::uint8_t Priority, typename Runnable>
+		void push_to_owner(std::size_t owner, Runnable&& runnable) {
+			queue_wrapper& qw = queue_wrapper::instance();
+			if (qw.is_responsive(owner)) {
+				qw.push_resume(owner, job{ std::forward<Runnable>(runnable) });
+				queue_wrapper::counters().resumedViaInbox.fetch_add(1, std::memory_order_relaxed);
+			}
+			else {
+				nova::push<priority<Priority>>(std::forward<Runnable>(runnable));
+				queue_wrapper::counters().resumedElsewhere.fetch_add(1, std::memory_order_relaxed);
+			}
+		}
+
+		// Runs when a call's token is released for the last time. Hands the caller to the releasing worker if it's
+		// between jobs and on the right thread, otherwise queues its resumption at the call's priority.
+		template<std::size_t ReturnThread, std::uint8_t Priority>
+		void resume_call(fiber* oldFiber, std::size_t owner) {
+			fiber** slot = resources::resume_slot();
+			if (slot && !*slot && on_thread<ReturnThread>(owner)) {
+				*slot = oldFiber;
+				if constexpr(ReturnThread == same_thread)
+					queue_wrapper::counters().resumedDirectly.fetch_add(1, std::memory_order_relaxed);
+			}
+			else if constexpr(ReturnThread == same_thread)
+				push_to_owner<Priority>(owner, finish_called_job_runnable{ oldFiber });
+			else
+				nova::push<to_thread<ReturnThread>, priority<Priority>>(finish_called_job_runnable{ oldFiber });
+		}
+
+		// Whether the caller can run a job itself rather than queueing it. The job has to be allowed on this thread, and
+		// what's left of the calling fiber's stack has to be as big as the stack_size it asked for, or half the default
+		// stack if it didn't ask.
+		template<std::size_t ToThread>
+		bool can_run_inline(job & j) {
+			if (!on_thread<ToThread>())
+				return false;
+			if (fiber::current()->stack_class() == thread_stack_class)
+				return false;
+			std::uint8_t stackClass = j.stack_class();
+			if (stackClass == any_stack_class)
+				return true;
+			std::size_t needed = (stackClass == default_stack_class)
+				? stack_class_size(resources::default_stack_class()) / 2
+				: stack_class_size(stackClass);
+			return fiber::stack_left() >= needed;
 		}
 
-		//Starting point for a new fiber, queues a list of jobs and immediately enters the job loop.
-		//This is used by the Call- functions to delay queueing of jobs until after the calling fiber
-		//has been suspended.
-		inline void open_call_token_enter_job_loop(LPVOID jobPtr) {
-			resources::call_token()->Release();
-			worker_thread::job_loop();
-			SwitchToFiber(resources::initial_fiber());
+		// Suspends the calling fiber until every other copy of the call's token has been released.
+		template<typename ... Controls>
+		void suspend_call(dependency_token & dt) {
+			//The new fiber releases the caller's copy of the token, which delays completion until the caller has been suspended.
+			//It's likely to run the invokees, so it's sized for them.
+			dependency_token * dependent = resources::dependent_token();
+			fiber ** resumeSlot = resources::resume_slot();
+			resources::resume_slot() = nullptr;
+			resources::call_token() = &dt;
+			get_fresh_fiber(resources::resolve_stack_class(stack_class_of<Controls...>::value))->switch_to();
+			resources::dependent_token() = dependent;
+			resources::resume_slot() = resumeSlot;
 		}
 
-		template<typename ... Controls, typename ... Params>
-		void call(Params&&... params) {
-			PVOID currentFiber = GetCurrentFiber();
+		template<typename ... Controls>
+		void call() {
+			fiber* currentFiber = fiber::current();
+			std::size_t owner = worker_thread::get_thread_id();
 			auto completionJob = [=]() {
-				nova::push<std::conditional_t<includes_type<return_main, Controls...>::value, to_main, void>>(bind(&finish_called_job, currentFiber));
+				resume_call<return_thread_of<Controls...>::value, priority_of<Controls...>::value>(currentFiber, owner);
 			};
 
 			dependency_token dt(job{ &completionJob });
-			resources::call_token() = &dt;
+			suspend_call<Controls...>(dt);
+		}
+
+		// Help-first: the caller queues all but the last job and runs that one itself, then only suspends if the others
+		// haven't all returned by the time it's done.
+		template<typename ... Controls, std::size_t N>
+		void call(std::array<job, N> && jobs, std::vector<job> && batchJobs) {
+			constexpr std::size_t ToThread = target_thread_of<Controls...>::value;
+			constexpr std::size_t ReturnThread = return_thread_of<Controls...>::value;
+			constexpr std::uint8_t Priority = priority_of<Controls...>::value;
+
+			fiber* currentFiber = fiber::current();
+			std::size_t owner = worker_thread::get_thread_id();
+			bool finishedInline = false;
+			auto completionJob = [currentFiber, owner, &finishedInline]() {
+				if (!finishedInline)
+					resume_call<ReturnThread, Priority>(currentFiber, owner);
+			};
+
+			dependency_token dt(job{ &completionJob });
+
+			std::size_t jobCount = N;
+			std::size_t batchCount = batchJobs.size();
+			job* last = batchCount ? batchJobs.data() + batchCount - 1 : (jobCount ? jobs.data() + jobCount - 1 : nullptr);
+			job inlineJob;
+			bool runInline = last && can_run_inline<ToThread>(*last);
+			if (runInline) {
+				inlineJob = std::move(*last);
+				if (batchCount)
+					batchCount--;
+				else
+					jobCount--;
+			}
 
-			call_push<includes_type<to_main, Controls...>::value>(dt, std::forward<Params>(params)...);
+			call_push<ToThread, Priority>(dt, jobs.data(), jobCount);
+			call_push<ToThread, Priority>(dt, batchJobs.data(), batchCount);
+
+			if (runInline) {
+				inlineJob.set_dependency_token(dt);
+				worker_thread::run_job(inlineJob);
+				inlineJob.get_dependency_token().Release();
+				if (on_thread<ReturnThread>(owner) && is_last_copy(dt)) {
+					//Releasing the token runs completionJob here, which sees there's nothing to resume
+					finishedInline = true;
+					if constexpr(ReturnThread == same_thread)
+						queue_wrapper::counters().completedInline.fetch_add(1, std::memory_order_relaxed);
+					return;
+				}
+			}
 
-			SwitchToFiber(get_fresh_fiber(open_call_token_enter_job_loop));
+			suspend_call<Controls...>(dt);
 		}
 
 	}
@@ -1045,12 +3686,26 @@ namespace nova {
 	// Accepts the following Controls:
 	// to_main - the Runnables will be invoked on the main thread
 	// return_main - the call will return to the main thread
+	// to_thread<ThreadId> - the Runnables will be invoked on the thread with the given id
+	// return_to_thread<ThreadId> - the call will return to the thread with the given id
+	// numa_node<Node> - the Runnables will be queued for the threads on the given NUMA node
+	// return_same - the call will return to the thread it was called from, unless that thread is stuck in another job
+	// stack_size<Bytes> - the Runnables will be invoked on fibers with Bytes of stack (rounded up to a power of two)
+	// priority<Level> - the Runnables, and the caller when it resumes, will be queued at the given priority level
+	// The last Runnable is invoked by the caller when the rest of its stack is big enough, in which case the call only
+	// suspends if the others are still running when it returns.
 	template<typename ... Controls, typename ... Runnables>
 	void call(Runnables&&... runnables) {
 		using namespace impl;
 		std::array<job, sizeof...(Runnables)-batch_count<Runnables...>::value> jobs;
 		std::vector<job> batchJobs;
 		pack_runnable<false>(jobs, batchJobs, std::forward<Runnables>(runnables)...);
+		if constexpr(stack_class_of<Controls...>::value != default_stack_class) {
+			for (job & j : jobs)
+				j.set_stack_class(stack_class_of<Controls...>::value);
+			for (job & j : batchJobs)
+				j.set_stack_class(stack_class_of<Controls...>::value);
+		}
 		impl::call<Controls...>(std::move(jobs), std::move(batchJobs));
 	}
 
@@ -1062,53 +3717,492 @@ namespace nova {
 	// Invokes a Callable object once for each value between start (inclusive) and end (exclusive), passing the value to each invocation.
 	template<typename Callable, typename ... Params>
 	void parallel_for(std::size_t start, std::size_t end, Callable&& callable, Params&&... args) {
-		call(bind_batch([&](std::size_t start, std::size_t end, Params&&... args) {
+		nova::call(bind_batch([&](std::size_t start, std::size_t end, Params&&... args) {
 			for (std::size_t c = start; c < end; c++)
 				std::forward<Callable>(callable)(c, std::forward<Params>(args)...);
 		}, start, end, std::forward<Params>(args)...));
 	}
 
-	// Starts the job system with the given number of threads and enters the given Callable with the given parameters. Returns when kill_all_workers is called.
+#if NOVA_COROUTINES
+#pragma region coroutines
+
+	template<typename T = void>
+	class task;
+
+	namespace impl {
+		// Resumes a suspended task with the dependent token of its frame, restoring the caller's afterwards.
+		inline void resume_task(std::coroutine_handle<> handle, dependency_token * dependent) {
+			dependency_token * outer = resources::dependent_token();
+			resources::dependent_token() = dependent;
+			handle.resume();
+			resources::dependent_token() = outer;
+		}
+
+		struct resume_task_runnable {
+			std::coroutine_handle<> handle;
+			dependency_token * dependent;
+
+			void operator()() {
+				resume_task(handle, dependent);
+			}
+		};
+
+		inline void resume_token_waiters(token_waiter* waiters) {
+			while (waiters) {
+				token_waiter* next = waiters->next;
+				nova::push(resume_task_runnable{ waiters->handle, waiters->dependent });
+				waiters = next;
+			}
+		}
+
+		class task_promise_base {
+		public:
+			struct final_awaiter {
+				bool await_ready() const noexcept { return false; }
+
+				template<typename Promise>
+				std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+					task_promise_base & promise = handle.promise();
+					if (promise.m_continuation) {
+						resources::dependent_token() = promise.m_continuationToken;
+						return promise.m_continuation;
+					}
+					//Detached tasks own their frames
+					handle.destroy();
+					return std::noop_coroutine();
+				}
+
+				void await_resume() const noexcept {}
+			};
+
+			std::suspend_always initial_suspend() const noexcept { return {}; }
+			final_awaiter final_suspend() const noexcept { return {}; }
+
+			void unhandled_exception() {
+				if (!m_continuation)
+					std::terminate();
+				m_exception = std::current_exception();
+			}
+
+			// Copy of the dependent token of whatever started the task, so a call or a dependent push waits for it to finish.
+			dependency_token m_token;
+			std::coroutine_handle<> m_continuation;
+			dependency_token * m_continuationToken = nullptr;
+			std::exception_ptr m_exception;
+		};
+
+		template<typename T>
+		class task_promise : public task_promise_base {
+		public:
+			task<T> get_return_object();
+
+			template<typename U>
+			void return_value(U&& value) {
+				m_value.emplace(std::forward<U>(value));
+			}
+
+			T get_result() {
+				if (m_exception)
+					std::rethrow_exception(m_exception);
+				return std::move(*m_value);
+			}
+		private:
+			std::optional<T> m_value;
+		};
+
+		template<>
+		class task_promise<void> : public task_promise_base {
+		public:
+			task<void> get_return_object();
+
+			void return_void() {}
+
+			void get_result() {
+				if (m_exception)
+					std::rethrow_exception(m_exception);
+			}
+		};
+
+		template<typename Promise>
+		dependency_token * task_token(std::coroutine_handle<Promise> handle) {
+			static_assert(std::is_base_of<task_promise_base, Promise>::value, "only nova::task can await this");
+			return &handle.promise().m_token;
+		}
+
+		// Pushes a set of jobs when awaited and resumes the awaiting task once they've all returned.
+		template<std::size_t ToThread, std::size_t ReturnThread, std::uint8_t Priority, std::size_t N>
+		class call_awaiter {
+		public:
+			call_awaiter(std::array<job, N> && jobs, std::vector<job> && batchJobs)
+				: m_jobs(std::move(jobs)), m_batchJobs(std::move(batchJobs)) {
+			}
+
+			bool await_ready() const noexcept { return false; }
+
+			template<typename Promise>
+			void await_suspend(std::coroutine_handle<Promise> handle) {
+				resume_task_runnable resume{ handle, task_token(handle) };
+				std::size_t owner = worker_thread::get_thread_id();
+				dependency_token dt([resume, owner]() {
+					if constexpr(ReturnThread == same_thread)
+						push_to_owner<Priority>(owner, resume_task_runnable(resume));
+					else
+						nova::push<to_thread<ReturnThread>, priority<Priority>>(resume_task_runnable(resume));
+				});
+
+				//The task can be resumed on another thread as soon as dt is released, so the awaiter isn't touched afterwards
+				call_push<ToThread, Priority>(dt, std::move(m_jobs), std::move(m_batchJobs));
+			}
+
+			void await_resume() const noexcept {}
+		private:
+			std::array<job, N> m_jobs;
+			std::vector<job> m_batchJobs;
+		};
+	}
+
+	// A lazily started C++20 coroutine that runs on the job system without a fiber of its own. It starts when it's
+	// invoked as a Runnable (by push, call, etc.) or when it's awaited from another task. Awaiting it yields its result.
+	template<typename T>
+	class task {
+	public:
+		using promise_type = impl::task_promise<T>;
+
+		task(task && other) noexcept
+			: m_handle(std::exchange(other.m_handle, nullptr)) {
+		}
+
+		task& operator=(task && other) noexcept {
+			if (this != &other) {
+				if (m_handle)
+					m_handle.destroy();
+				m_handle = std::exchange(other.m_handle, nullptr);
+			}
+			return *this;
+		}
+
+		~task() {
+			if (m_handle)
+				m_handle.destroy();
+		}
+
+		// Starts the task and detaches it. It holds a copy of the current dependent token until it finishes.
+		void operator()() {
+			std::coroutine_handle<promise_type> handle = std::exchange(m_handle, nullptr);
+			if (impl::resources::dependent_token())
+				handle.promise().m_token = *impl::resources::dependent_token();
+			impl::resume_task(handle, &handle.promise().m_token);
+		}
+
+		class awaiter {
+		public:
+			explicit awaiter(std::coroutine_handle<promise_type> handle)
+				: m_handle(handle) {
+			}
+
+			bool await_ready() const noexcept { return false; }
+
+			template<typename Promise>
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> continuation) {
+				impl::task_promise_base & promise = m_handle.promise();
+				promise.m_continuation = continuation;
+				promise.m_continuationToken = impl::task_token(continuation);
+				promise.m_token = *promise.m_continuationToken;
+				impl::resources::dependent_token() = &promise.m_token;
+				return m_handle;
+			}
+
+			T await_resume() {
+				return m_handle.promise().get_result();
+			}
+		private:
+			std::coroutine_handle<promise_type> m_handle;
+		};
+
+		awaiter operator co_await() && {
+			return awaiter(m_handle);
+		}
+	private:
+		friend promise_type;
+
+		explicit task(std::coroutine_handle<promise_type> handle)
+			: m_handle(handle) {
+		}
+
+		std::coroutine_handle<promise_type> m_handle;
+	};
+
+	namespace impl {
+		template<typename T>
+		task<T> task_promise<T>::get_return_object() {
+			return task<T>(std::coroutine_handle<task_promise>::from_promise(*this));
+		}
+
+		inline task<void> task_promise<void>::get_return_object() {
+			return task<void>(std::coroutine_handle<task_promise>::from_promise(*this));
+		}
+	}
+
+	class dependency_token::awaiter {
+	public:
+		explicit awaiter(dependency_token && dt)
+			: m_token(std::move(dt)) {
+		}
+
+		bool await_ready() const noexcept {
+			return !m_token.m_token;
+		}
+
+		template<typename Promise>
+		void await_suspend(std::coroutine_handle<Promise> handle) {
+			m_waiter = { handle, impl::task_token(handle), nullptr };
+			std::atomic<impl::token_waiter*> & waiters = m_token.m_token->m_waiters;
+			m_waiter.next = waiters.load(std::memory_order_relaxed);
+			while (!waiters.compare_exchange_weak(m_waiter.next, &m_waiter, std::memory_order_release, std::memory_order_relaxed));
+
+			//Releasing this copy may be what completes the token, which resumes the task
+			dependency_token released = std::move(m_token);
+		}
+
+		void await_resume() const noexcept {}
+	private:
+		dependency_token m_token;
+		impl::token_waiter m_waiter;
+	};
+
+	inline dependency_token::awaiter dependency_token::operator co_await() && {
+		return awaiter(std::move(*this));
+	}
+
+	// Awaitable counterpart of call for use inside a task. Awaiting the result pushes the Runnables and suspends the task
+	// until they've all returned, leaving the worker free to run other jobs. Accepts the same Controls as call.
+	template<typename ... Controls, typename ... Runnables>
+	auto co_call(Runnables&&... runnables) {
+		using namespace impl;
+		constexpr std::size_t N = sizeof...(Runnables)-batch_count<Runnables...>::value;
+		std::array<job, N> jobs;
+		std::vector<job> batchJobs;
+#if defined(NOVA_REPORT_SPILLS)
+		report_token_spills<Runnables...>();
+#endif
+		if constexpr(sizeof...(Runnables) > 0)
+			pack_runnable<true, stack_class_of<Controls...>::value>(jobs, batchJobs, std::forward<Runnables>(runnables)...);
+		return call_awaiter<impl::target_thread_of<Controls...>::value, impl::return_thread_of<Controls...>::value, impl::priority_of<Controls...>::value, N>(std::move(jobs), std::move(batchJobs));
+	}
+
+	// Awaitable counterpart of switch_to_main for use inside a task.
+	inline auto co_switch_to_main() {
+		return co_call<return_main>();
+	}
+
+#pragma endregion
+#endif
+
+	// Options for start_sync and start_async.
+	struct start_options {
+		// Number of worker threads, including the main thread.
+		unsigned thread_count = std::thread::hardware_concurrency();
+		// Stack size of fibers running Runnables that weren't given one with stack_size, rounded up to a power of two. On Windows this
+		// is the reserve size; elsewhere the stack is mapped with a guard page below it.
+		std::size_t stack_size = NOVA_FIBER_STACK_BYTES;
+		// Number of fibers each thread creates up front, so the first calls don't pay for fiber creation.
+		std::size_t prewarm_fibers = 0;
+		// Idle fibers give their stack memory back to the system once they've been idle this long: those in the shared pool through
+		// a background thread, and those cached by a thread once that thread has been parked this long. Zero disables trimming.
+		std::chrono::milliseconds fiber_trim_age = std::chrono::milliseconds(0);
+		// Save and restore the floating-point control state (MXCSR and the x87 control word, or FPCR) on fiber switches. Turning
+		// this off makes switches cheaper, but jobs that change rounding modes or flush-to-zero then leak the change to whatever
+		// runs next on their thread, and don't take it with them when they move.
+		bool float_state = true;
+		// Give every thread its own work-stealing deque instead of sharing one queue. Jobs a thread pushes go on its own deque,
+		// which it works through newest first while idle threads steal the oldest. The shared queue is left to threads outside the pool.
+		bool work_stealing = false;
+		// Most time an idle thread spends spinning before it sleeps, in pause instructions. Each thread adapts its own budget
+		// below this, spinning longer while spinning keeps finding work. Zero makes idle threads sleep straight away.
+		unsigned max_spin = NOVA_SPIN_COUNT;
+		// How long the thread a return_same call was made from can be busy with one job before the caller is resumed on another
+		// thread instead of waiting for it.
+		std::chrono::microseconds return_same_wait = std::chrono::microseconds(NOVA_RETURN_SAME_WAIT_US);
+		// Pin each thread to a CPU, so the OS doesn't migrate it. Linux only; see thread_placement. Pinned threads are grouped by
+		// NUMA node, and look for shared work on their own node before other nodes'.
+		thread_placement placement = thread_placement::none;
+	};
+
+	// Fiber pool counters, see get_fiber_pool_stats.
+	struct fiber_pool_stats {
+		// Fibers created so far, including prewarmed ones.
+		std::size_t fibers_created;
+		// Fibers created up front because of start_options::prewarm_fibers.
+		std::size_t fibers_prewarmed;
+		// Idle fibers currently in the shared pool. Fibers cached by individual threads aren't counted.
+		std::size_t shared_pool_fibers;
+		// Idle fibers whose stacks have been trimmed, and the size of the stack ranges released, including pages that were never
+		// touched. On Windows trimmed fibers are deleted.
+		std::size_t fibers_trimmed;
+		std::size_t bytes_trimmed;
+	};
+
+	// Returns the fiber pool counters, which accumulate across runs of the job system.
+	inline fiber_pool_stats get_fiber_pool_stats() {
+		impl::fiber_depot::counters_t& counters = impl::fiber_depot::counters();
+		return {
+			counters.created.load(std::memory_order_relaxed),
+			counters.prewarmed.load(std::memory_order_relaxed),
+			counters.depotFibers.load(std::memory_order_relaxed),
+			counters.trimmedFibers.load(std::memory_order_relaxed),
+			counters.trimmedBytes.load(std::memory_order_relaxed)
+		};
+	}
+
+	// Where calls made with return_same returned, see get_return_same_stats.
+	struct return_same_stats {
+		// Never suspended, because the caller ran the last Runnable itself and the others had returned by then.
+		std::size_t completed_inline;
+		// Suspended, then resumed straight away by the worker that finished the call, which was the thread the call was made from.
+		std::size_t resumed_directly;
+		// Queued for the thread the call was made from, and resumed by it.
+		std::size_t resumed_via_inbox;
+		// Queued for any thread, or taken from the inbox by another thread, because the thread the call was made from was busy
+		// past start_options::return_same_wait.
+		std::size_t resumed_elsewhere;
+	};
+
+	// Work stealing counters, see get_steal_stats.
+	struct steal_stats {
+		// Jobs stolen from a thread pinned to a CPU that shares a cache with the thief's.
+		std::size_t local_steals;
+		// Jobs stolen from any other thread, including all steals between threads that aren't pinned.
+		std::size_t remote_steals;
+		// Threads of runs with a placement other than none that ran unpinned, because the CPU topology couldn't be read from
+		// sysfs or sched_setaffinity failed. Always the whole pool off Linux.
+		std::size_t unpinned_threads;
+	};
+
+	// Returns the work stealing counters, which accumulate across runs of the job system.
+	inline steal_stats get_steal_stats() {
+		impl::queue_wrapper::counters_t& counters = impl::queue_wrapper::counters();
+		return {
+			counters.localSteals.load(std::memory_order_relaxed),
+			counters.remoteSteals.load(std::memory_order_relaxed),
+			counters.unpinnedThreads.load(std::memory_order_relaxed)
+		};
+	}
+
+	// Returns the return_same counters, which accumulate across runs of the job system.
+	inline return_same_stats get_return_same_stats() {
+		impl::queue_wrapper::counters_t& counters = impl::queue_wrapper::counters();
+		return {
+			counters.completedInline.load(std::memory_order_relaxed),
+			counters.resumedDirectly.load(std::memory_order_relaxed),
+			counters.resumedViaInbox.load(std::memory_order_relaxed),
+			counters.resumedElsewhere.load(std::memory_order_relaxed)
+		};
+	}
+
+	// Spill pool counters, see get_spill_pool_stats.
+	struct spill_pool_stats {
+		// Runnables too big for their job that got a block some thread had freed.
+		std::size_t hits;
+		// Runnables that needed a new slab, or were too big for the pools and went straight to the heap.
+		std::size_t misses;
+		// Blocks freed on a thread other than the one that allocated them.
+		std::size_t remote_frees;
+	};
+
+	// Returns the spill pool counters, which accumulate across runs of the job system.
+	inline spill_pool_stats get_spill_pool_stats() {
+		impl::spill_pool::counters_t counters = impl::spill_pool::counters();
+		return { counters.hits, counters.misses, counters.remoteFrees };
+	}
+
+	namespace impl {
+		template<typename Callable>
+		using enable_if_not_options_t = std::enable_if_t<!std::is_same<std::decay_t<Callable>, start_options>::value && !std::is_integral<std::decay_t<Callable>>::value, int>;
+
+		inline void apply_start_options(const start_options& options) {
+			resources::default_stack_class() = stack_class_for(options.stack_size);
+			resources::prewarm_fibers() = options.prewarm_fibers;
+			resources::fiber_trim_age() = options.fiber_trim_age;
+			fiber::float_state() = options.float_state;
+			worker_thread::set_thread_count(options.thread_count);
+			worker_thread::placement() = cpu_topology::placement_order(options.placement);
+			// Without a readable topology there's nothing to pin to, so the whole run goes unpinned.
+			if (options.placement != thread_placement::none && worker_thread::placement().empty())
+				queue_wrapper::counters().unpinnedThreads.fetch_add(options.thread_count, std::memory_order_relaxed);
+			queue_wrapper::instance().begin_run(options.thread_count, options.work_stealing, options.max_spin, options.return_same_wait,
+				cpu_topology::layout(worker_thread::placement(), options.thread_count));
+		}
+	}
+
+	// Starts the job system with the given options and enters the given Callable with the given parameters. Returns when kill_all_workers is called.
 	template <typename Callable, typename ... Params>
-	void start_async(unsigned threadCount, Callable&& callable, Params&& ... args) {
+	void start_async(const start_options& options, Callable&& callable, Params&& ... args) {
 		using namespace impl;
 
+		apply_start_options(options);
+		main_thread_affinity affinity(worker_thread::placement());
+		fiber_trimmer trimmer(options.fiber_trim_age);
+
 		//create threads
 		std::vector<worker_thread> threads;
 
-		threads.resize(threadCount - 1);
+		threads.resize(options.thread_count - 1);
 
 		queue_wrapper::thread_data td = queue_wrapper::instance().make_thread_data();
 		queue_wrapper::current_thread_data() = &td;
-		ConvertThreadToFiberEx(NULL, FIBER_FLAG_FLOAT_SWITCH);
+		queue_wrapper::instance().register_thread(0, td);
+		resources::initial_fiber() = fiber::convert_thread();
+		resources::prewarm_fiber_pool();
 
 		push<nova::to_main>(bind(std::forward<Callable>(callable), std::forward<Params>(args)...));
 
-		worker_thread::job_loop();
+		//Like the workers, the main thread runs its job loop on pooled fibers, since a job that calls can resume on another
+		//thread. Whichever fiber picks up the main thread's kill job comes back here.
+		get_fresh_fiber(resources::default_stack_class())->switch_to();
 
 		for (worker_thread & wt : threads)
 			wt.Join();
+		queue_wrapper::instance().end_run();
+		resources::delete_fiber_pool();
+		trimmer.stop();
+		fiber_depot::delete_fibers();
+		fiber::revert_thread();
+		resources::release_stack_cache();
 	}
 
-	// Starts the job system with as many threads as the system can run concurrently and enters the given Callable with the given parameters. Returns when kill_all_workers is called.
+	// Starts the job system with the given number of threads and enters the given Callable with the given parameters. Returns when kill_all_workers is called.
 	template <typename Callable, typename ... Params>
+	void start_async(unsigned threadCount, Callable&& callable, Params&& ... args) {
+		start_options options;
+		options.thread_count = threadCount;
+		start_async(options, std::forward<Callable>(callable), std::forward<Params>(args)...);
+	}
+
+	// Starts the job system with as many threads as the system can run concurrently and enters the given Callable with the given parameters. Returns when kill_all_workers is called.
+	template <typename Callable, typename ... Params, impl::enable_if_not_options_t<Callable> = 0>
 	void start_async(Callable&& callable, Params&& ... args) {
-		start_async(std::thread::hardware_concurrency(), std::forward<Callable>(callable), std::forward<Params>(args)...);
+		start_async(start_options(), std::forward<Callable>(callable), std::forward<Params>(args)...);
 	}
 
-	//Starts the job system with the given number of threads and enters the given Callable with the given parameters. Returns when the Callable returns.
+	//Starts the job system with the given options and enters the given Callable with the given parameters. Returns when the Callable returns.
 	template <typename Callable, typename ... Params>
-	void start_sync(unsigned threadCount, Callable&& callable, Params&& ... args) {
+	void start_sync(const start_options& options, Callable&& callable, Params&& ... args) {
 		using namespace impl;
 
+		apply_start_options(options);
+		main_thread_affinity affinity(worker_thread::placement());
+		fiber_trimmer trimmer(options.fiber_trim_age);
+
 		//create threads
 		std::vector<worker_thread> threads;
 
-		threads.resize(threadCount - 1);
+		threads.resize(options.thread_count - 1);
 
 		queue_wrapper::thread_data td = queue_wrapper::instance().make_thread_data();
 		queue_wrapper::current_thread_data() = &td;
-		ConvertThreadToFiberEx(NULL, FIBER_FLAG_FLOAT_SWITCH);
+		queue_wrapper::instance().register_thread(0, td);
+		fiber::convert_thread();
+		resources::prewarm_fiber_pool();
 
 		nova::call<nova::to_main, nova::return_main>(bind(std::forward<Callable>(callable), std::forward<Params>(args)...));
 
@@ -1117,13 +4211,32 @@ namespace nova {
 			push(bind(worker_thread::kill_worker));
 		for (worker_thread & wt : threads)
 			wt.Join();
+		queue_wrapper::instance().end_run();
 		resources::delete_fiber_pool();
+		trimmer.stop();
+		fiber_depot::delete_fibers();
+		fiber::revert_thread();
+		resources::release_stack_cache();
 	}
 
-	//Starts the job system with as many threads as the system can run concurrently and enters the given Callable with the given parameters. Returns when the Callable returns.
+	//Starts the job system with the given number of threads and enters the given Callable with the given parameters. Returns when the Callable returns.
 	template <typename Callable, typename ... Params>
+	void start_sync(unsigned threadCount, Callable&& callable, Params&& ... args) {
+		start_options options;
+		options.thread_count = threadCount;
+		start_sync(options, std::forward<Callable>(callable), std::forward<Params>(args)...);
+	}
+
+	//Starts the job system with as many threads as the system can run concurrently and enters the given Callable with the given parameters. Returns when the Callable returns.
+	template <typename Callable, typename ... Params, impl::enable_if_not_options_t<Callable> = 0>
 	void start_sync(Callable&& callable, Params&& ... args) {
-		start_sync(std::thread::hardware_concurrency(), std::forward<Callable>(callable), std::forward<Params>(args)...);
+		start_sync(start_options(), std::forward<Callable>(callable), std::forward<Params>(args)...);
+	}
+
+	// Returns the id of the current thread: 0 for the main thread and 1 through thread_count - 1 for the workers. With
+	// start_options::placement set, each id is pinned to the same CPU every run.
+	inline std::size_t get_thread_id() {
+		return impl::worker_thread::get_thread_id();
 	}
 
 	// Stops the job system, triggering a return from the start function. No invocations attempted after this one will occur.